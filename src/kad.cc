@@ -4,543 +4,3716 @@
 #include <rocksdb/slice.h>
 #include <rocksdb/write_batch.h>
 #include <rocksdb/comparator.h>
+#include <rocksdb/sst_file_writer.h>
+#include <rocksdb/table.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/cache.h>
+#include <rocksdb/write_buffer_manager.h>
+#include <rocksdb/utilities/checkpoint.h>
+#include <rocksdb/utilities/backup_engine.h>
+#include <rocksdb/perf_context.h>
 #include <cassert>
 #include <stdlib.h>
 #include <math.h> // floor()
 #include <cinttypes>
+#include <ctime>
+#include <sys/time.h> // gettimeofday()
 #include <sys/stat.h> // mkdir()
 #include <sys/param.h> // MAXPATHLEN
+#include <unistd.h> // getpid()
+#include <getopt.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <csignal>
+#include <cerrno>
+#ifdef KAD_ZSTD
+#include <zstd.h>
+#endif
 
 #include "kseq.h"
 #include "kstring.h"
+#include "libkad_internal.h"
 
 KSEQ_INIT(gzFile, gzread)
 
-#define KAD_VERSION "0.0.4"
 #define KAD_DB_PREFIX ".kad"
+#define KAD_BULK_WRITE_BUFFER_SIZE (256 << 20)
+#define KAD_BULK_MAX_WRITE_BUFFER_NUMBER 6
+#define KAD_COMPACT_SLICES 20
+#define KAD_SCAN_SLICES_PER_THREAD 16
+#define KAD_COPY_RETRIES 5
+#define KAD_PROFILE_BATCH 1024 // records profiled together
+#define KAD_PROFILE_WINDOW 50
+#define KAD_GEN_CHUNK 65536 // k-mers generated and compressed together
 
-#define KMER_LENGTH 32
 #define NB_KMERS_PRINT 1000000
 #define BUFFER_SIZE 10000
+#define KAD_QUERY_BYTES (256 << 20) // query buffers without --memory
+#define KAD_QUERY_BLOCK_BYTES 4096 // block pinned by a key of a batch lookup
+#define KAD_QUERY_MIN_BATCH 64
+#define KAD_NEIGHBOR_BYTES (sizeof(neighbor_t) + 2 * sizeof(uint64_t)) // neighbor, key and found
+#define BULK_RUN_BYTES (256 << 20)
+#define BULK_COLUMN_CHUNK 256
+#define KAD_INPUT_BUFFER (4 << 20) // read-ahead of the count files and pipes
+#define KAD_RECORD_BYTES 12 // binary record: uint64 k-mer, uint32 count
+#define KAD_PROGRESS_SECONDS 10
+#define KAD_SET_TABLE_SLOTS 16 // set expressions with a truth table
+#define KAD_OUT_BUFFER (1 << 20) // output written by chunks of this size
 
-enum DNA_MAP {A, C, G, T};  // A=1, C=0, T=2, G=3
 static const char NUCLEOTIDES[4] = { 'A', 'C', 'G', 'T' };
 
 struct stat sb; // Use to check if files/directories exists
 
 using namespace std;
 
-uint64_t str_to_int(char* str)
+/* Exit with code if a libkad function failed, returns its status otherwise */
+int kad_check(int status, int code) {
+  if(status < 0) {
+    cerr << kad_last_error() << endl;
+    exit(code);
+  }
+  return status;
+}
+
+/* A secondary instance that fails to catch up keeps reading its last state */
+void kad_follow(kad_db_t* db) {
+  if(kad_catch_up(db) < 0)
+    cerr << "Failed to catch up with the primary: " << kad_last_error() << endl;
+}
+
+/* Parse a size such as 512M or 8G, in bytes without a suffix */
+size_t parse_size(const char* str) {
+  char* end;
+  double size = strtod(str, &end);
+  int valid = end != str && size >= 0;
+  if(*end) {
+    switch (toupper(*end)) {
+      case 'K': size *= 1ULL << 10; break;
+      case 'M': size *= 1ULL << 20; break;
+      case 'G': size *= 1ULL << 30; break;
+      case 'T': size *= 1ULL << 40; break;
+      default: valid = 0;
+    }
+    valid = valid && end[1] == '\0';
+  }
+  // Also rejects inf, before the conversion
+  valid = valid && size < (double)(1ULL << 62);
+  if(!valid) {
+    cerr << "Invalid size: " << str << " (expected a number followed by K, M, G or T)" << endl;
+    exit(1);
+  }
+  return size;
+}
+
+/* Memory used by RocksDB, reported by kad --stats */
+void print_memory_report(kad_db_t* db) {
+  kad_memory_t* memory = db->memory;
+  cerr << "# Memory (MB)" << endl;
+  if(memory) {
+    cerr << "Budget\t" << (memory->total >> 20) << endl;
+    cerr << "Block cache (memtables included)\t" << (memory->cache->GetUsage() >> 20)
+      << " / " << (memory->cache->GetCapacity() >> 20)
+      << " (pinned " << (memory->cache->GetPinnedUsage() >> 20) << ")" << endl;
+    cerr << "Memtables\t" << (memory->write_buffer_manager->memory_usage() >> 20)
+      << " / " << (memory->write_buffers >> 20) << endl;
+    cerr << "Ingest buffers\t" << (memory->ingest >> 20) << endl;
+  } else {
+    cerr << "Budget\tnone (RocksDB defaults)" << endl;
+  }
+  const char* properties[] = { "rocksdb.cur-size-all-mem-tables", "rocksdb.block-cache-usage",
+    "rocksdb.estimate-table-readers-mem" };
+  rocksdb::DB* dbs[] = { db->counts_db, db->samples_db };
+  const char* names[] = { "counts", "samples" };
+  for (int i = 0; i < 2; i++) {
+    for (int j = 0; j < 3; j++) {
+      uint64_t value = 0;
+      if(dbs[i]->GetIntProperty(properties[j], &value))
+        cerr << names[i] << " " << properties[j] + strlen("rocksdb.") << "\t" << (value >> 20) << endl;
+    }
+  }
+  if(db->sketch)
+    cerr << "Sketch\t" << ((db->sketch->cells.size() * sizeof(uint16_t)) >> 20) << endl;
+}
+
+double kad_realtime() {
+  struct timeval tp;
+  gettimeofday(&tp, NULL);
+  return tp.tv_sec + tp.tv_usec * 1e-6;
+}
+
+/* Switch the counts database to the bulk-load profile: large memtables, no
+ * auto-compaction and no write stalls on the number of L0 files. The
+ * previous settings are saved in saved_options */
+void kad_bulk_begin(kad_db_t* db, rocksdb::Options* saved_options) {
+  *saved_options = db->counts_db->GetOptions();
+  size_t write_buffer_size = KAD_BULK_WRITE_BUFFER_SIZE;
+  if(db->memory)
+    write_buffer_size = min(write_buffer_size, max(db->memory->write_buffers / KAD_BULK_MAX_WRITE_BUFFER_NUMBER,
+        (size_t)KAD_MIN_WRITE_BUFFER));
+  rocksdb::Status s = db->counts_db->SetOptions({
+      { "write_buffer_size", to_string(write_buffer_size) },
+      { "max_write_buffer_number", to_string(KAD_BULK_MAX_WRITE_BUFFER_NUMBER) },
+      { "disable_auto_compactions", "true" },
+      { "level0_slowdown_writes_trigger", to_string(1 << 30) },
+      { "level0_stop_writes_trigger", to_string(1 << 30) },
+      { "soft_pending_compaction_bytes_limit", "0" },
+      { "hard_pending_compaction_bytes_limit", "0" }
+  });
+  if(!s.ok())
+    cerr << "Failed to set the bulk-load options: " << s.ToString() << endl;
+}
+
+/* Compact the whole counts database, one slice of the key space at a time
+ * to report the progress. If progress_key is set, the next slice to compact
+ * is stored under this key of samples_db after each slice, and the
+ * compaction starts again from there. Returns 0 if it was canceled */
+int kad_compact(kad_db_t* db, const rocksdb::CompactRangeOptions& compact_options, const char* progress_key) {
+  double t_start = kad_realtime();
+  uint64_t first_slice = 0;
+  string value;
+  if(progress_key && db->samples_db->Get(rocksdb::ReadOptions(), progress_key, &value).ok()
+      && value.size() == sizeof(uint64_t)) {
+    first_slice = *(uint64_t*)value.data();
+    fprintf(stderr, "Resuming the compaction at %d%%\n", (int)(first_slice * 100 / KAD_COMPACT_SLICES));
+  }
+
+  for (uint64_t i = first_slice; i < KAD_COMPACT_SLICES; i++) {
+    uint64_t begin_int = i * (UINT64_MAX / KAD_COMPACT_SLICES + 1);
+    uint64_t end_int = begin_int + (UINT64_MAX / KAD_COMPACT_SLICES);
+    char begin_buf[KAD_KEY_MAX_BYTES], end_buf[KAD_KEY_MAX_BYTES];
+    rocksdb::Slice begin = kad_position_key(db, begin_int, begin_buf);
+    rocksdb::Slice end = kad_position_key(db, end_int, end_buf);
+    rocksdb::Status s = db->counts_db->CompactRange(compact_options, i == 0 ? NULL : &begin,
+        i == KAD_COMPACT_SLICES - 1 ? NULL : &end);
+    if(!s.ok() && compact_options.canceled && compact_options.canceled->load()) {
+      fprintf(stderr, "Compaction interrupted at %d%%\n", (int)(i * 100 / KAD_COMPACT_SLICES));
+      return 0;
+    }
+    if(!s.ok()) {
+      cerr << "Compaction failed: " << s.ToString() << endl;
+      exit(4);
+    }
+    if(progress_key) {
+      uint64_t next_slice = i + 1;
+      if(next_slice < KAD_COMPACT_SLICES)
+        s = db->samples_db->Put(rocksdb::WriteOptions(), progress_key, rocksdb::Slice((char*)&next_slice, sizeof(uint64_t)));
+      else
+        s = db->samples_db->Delete(rocksdb::WriteOptions(), progress_key);
+      if(!s.ok()) {
+        cerr << "failed to store the progress of the compaction" << endl;
+        exit(3);
+      }
+    }
+    fprintf(stderr, "Compaction %3d%% done (%.1fs)\n", (int)((i + 1) * 100 / KAD_COMPACT_SLICES),
+        kad_realtime() - t_start);
+  }
+  return 1;
+}
+
+/* Leave the bulk-load profile: restore the saved settings, flush the
+ * memtables (nothing was written to the WAL) and compact the database */
+void kad_bulk_finish(kad_db_t* db, const rocksdb::Options& saved_options) {
+  rocksdb::Status s = db->counts_db->SetOptions({
+      { "write_buffer_size", to_string(saved_options.write_buffer_size) },
+      { "max_write_buffer_number", to_string(saved_options.max_write_buffer_number) },
+      { "disable_auto_compactions", saved_options.disable_auto_compactions ? "true" : "false" },
+      { "level0_slowdown_writes_trigger", to_string(saved_options.level0_slowdown_writes_trigger) },
+      { "level0_stop_writes_trigger", to_string(saved_options.level0_stop_writes_trigger) },
+      { "soft_pending_compaction_bytes_limit", to_string(saved_options.soft_pending_compaction_bytes_limit) },
+      { "hard_pending_compaction_bytes_limit", to_string(saved_options.hard_pending_compaction_bytes_limit) }
+  });
+  if(!s.ok())
+    cerr << "Failed to restore the database options: " << s.ToString() << endl;
+
+  s = db->counts_db->Flush(rocksdb::FlushOptions());
+  if(!s.ok()) {
+    cerr << "Failed to flush the counts database: " << s.ToString() << endl;
+    exit(4);
+  }
+
+  kad_compact(db, rocksdb::CompactRangeOptions(), NULL);
+}
+
+enum KAD_NORMALIZE { KAD_NORMALIZE_NONE, KAD_NORMALIZE_CPM };
+
+int parse_normalize(const char* str) {
+  if(strcmp(str, "none") == 0) return KAD_NORMALIZE_NONE;
+  if(strcmp(str, "cpm") == 0) return KAD_NORMALIZE_CPM;
+  cerr << "Unknown normalization: " << str << " (expected cpm or none)" << endl;
+  exit(1);
+}
+
+/* Name of the sample id, empty if there is none: the counts read by a
+ * secondary instance may be ahead of its samples */
+static inline string sample_name_of(kad_db_t* db, uint16_t id) {
+  return id < kad_nb_samples(db) ? db->samples[id].name : string();
+}
+
+/* Fill scale with the factor applied to the counts of each sample id. With
+ * KAD_NORMALIZE_NONE scale is left empty and the raw counts are printed */
+void load_sample_scale(kad_db_t* db, int normalize, vector<float>& scale) {
+  scale.clear();
+  if(normalize == KAD_NORMALIZE_NONE)
+    return;
+  scale.assign(UINT16_MAX + 1, 1.0f);
+  for (uint32_t id = 0; id < kad_nb_samples(db); id++) {
+    sample_totals_t totals;
+    if(get_sample_totals(db, id, &totals) && totals.total_count > 0) {
+      scale[id] = 1e6 / totals.total_count;
+    } else {
+      cerr << "No library size for sample " << sample_name_of(db, id)
+        << ", its counts are not normalized" << endl;
+    }
+  }
+}
+
+/* Convert a count list to floats with the sample factors, in a single loop
+ * with no other work so that it is vectorized */
+void scale_counts(const count_t* counts, size_t nb_counts, const float* scale, float* values) {
+  for(size_t i = 0; i < nb_counts; i++)
+    values[i] = counts[i].n * scale[counts[i].id];
+}
+
+void print_stats(const kad_stats_t* stats) {
+  cout << "# Support histogram (number of samples, number of k-mers)" << endl;
+  for (size_t i = 1; i < stats->support.size(); i++) {
+    if(stats->support[i] != 0)
+      cout << i << "\t" << stats->support[i] << endl;
+  }
+  cout << "# Count histogram (count range, number of sample counts)" << endl;
+  for (size_t b = 0; b < KAD_COUNT_BUCKETS; b++) {
+    if(stats->count_hist[b] == 0)
+      continue;
+    if(b <= 1)
+      cout << b;
+    else
+      cout << (1 << (b - 1)) << "-" << (1 << b) - 1;
+    cout << "\t" << stats->count_hist[b] << endl;
+  }
+}
+
+/* One line per sample with a histogram: id, name, number of k-mers and the
+ * number of k-mers in each count bucket from 1 */
+void print_sample_hists(kad_db_t* db, const vector<sample_hist_t>& hists, const vector<char>& has_hist) {
+  cout << "# Counts per sample (id, name, number of k-mers, then the number of k-mers with a count of 1, 2-3, "
+    << "4-7, ... " << (1 << (KAD_COUNT_BUCKETS - 2)) << "-" << (1 << (KAD_COUNT_BUCKETS - 1)) - 1 << ")" << endl;
+  for (size_t id = 0; id < hists.size(); id++) {
+    if(!has_hist[id])
+      continue;
+    int64_t nb_kmers = 0;
+    for (size_t b = 1; b < KAD_COUNT_BUCKETS; b++)
+      nb_kmers += hists[id].count_hist[b];
+    cout << id << "\t" << sample_name_of(db, id) << "\t" << nb_kmers;
+    for (size_t b = 1; b < KAD_COUNT_BUCKETS; b++)
+      cout << "\t" << hists[id].count_hist[b];
+    cout << endl;
+  }
+}
+
+/* Filter on the counts of a k-mer, evaluated directly on its count_t list.
+ * A sample supports a k-mer if its count is at least min_count. The k-mer
+ * passes if it is supported by min_support to max_support samples, and by
+ * at least min_support_in_set samples of the set */
+typedef struct {
+  vector<uint64_t> in_set; // bitmap of the sample ids of the set
+  size_t set_size;         // 0 when all the samples are selected
+  uint16_t min_count;
+  int min_support;
+  int max_support;
+  int min_support_in_set;
+} kad_filter_t;
+
+void kad_filter_init(kad_filter_t* filter) {
+  filter->in_set.assign((UINT16_MAX + 1) / 64, UINT64_MAX);
+  filter->set_size = 0;
+  filter->min_count = 0;
+  filter->min_support = 0;
+  filter->max_support = INT_MAX;
+  filter->min_support_in_set = 0;
+}
+
+/* Find the ids of the samples called name (a name indexed several times has
+ * several ids). Returns the number of ids found */
+size_t kad_sample_ids(kad_db_t* db, const char* name, vector<uint16_t>& ids) {
+  size_t n = 0;
+  for (uint32_t id = 0; id < kad_nb_samples(db); id++) {
+    if(sample_name_of(db, id) == name) {
+      ids.push_back(id);
+      n++;
+    }
+  }
+  return n;
+}
+
+static inline int kad_filter_in_set(const kad_filter_t* filter, uint16_t id) {
+  return (filter->in_set[id >> 6] >> (id & 63)) & 1;
+}
+
+/* Restrict the set to the comma-separated sample names of samples_list. The
+ * set size is the number of distinct sample ids: a name listed twice counts
+ * once, a name shared by several samples counts each of them. By default
+ * every sample of the set must support the k-mer */
+void kad_filter_set_samples(kad_db_t* db, kad_filter_t* filter, char* samples_list) {
+  filter->in_set.assign((UINT16_MAX + 1) / 64, 0);
+  filter->set_size = 0;
+
+  for (char *name = strtok(samples_list, ","); name; name = strtok(NULL, ",")) {
+    vector<uint16_t> ids;
+    if(kad_sample_ids(db, name, ids) == 0) {
+      cerr << "Unknown sample: " << name << endl;
+      exit(1);
+    }
+    for (size_t i = 0; i < ids.size(); i++) {
+      if(!kad_filter_in_set(filter, ids[i]))
+        filter->set_size++;
+      filter->in_set[ids[i] >> 6] |= 1ULL << (ids[i] & 63);
+    }
+  }
+  filter->min_support_in_set = filter->set_size;
+}
+
+int kad_filter_match(const kad_filter_t* filter, const count_t* counts, size_t nb_counts) {
+  int support = 0, support_in_set = 0;
+  for(size_t i = 0; i < nb_counts; i++) {
+    int pass = counts[i].n >= filter->min_count;
+    support += pass;
+    support_in_set += pass & kad_filter_in_set(filter, counts[i].id);
+  }
+  return support >= filter->min_support && support <= filter->max_support
+    && support_in_set >= filter->min_support_in_set;
+}
+
+enum KAD_OUT_FORMAT { KAD_OUT_TSV, KAD_OUT_BINARY };
+
+int parse_output_format(const char* str) {
+  if(strcmp(str, "tsv") == 0) return KAD_OUT_TSV;
+  if(strcmp(str, "binary") == 0) return KAD_OUT_BINARY;
+  cerr << "Unknown output format: " << str << " (expected tsv or binary)" << endl;
+  exit(1);
+}
+
+/* Output of the k-mers and their counts on stdout. The lines are formatted
+ * directly in a buffer of KAD_OUT_BUFFER bytes, written with write(2) when
+ * it is full: the k-mers are decoded 4 bases at a time with a table, the
+ * integers two digits at a time, and the sample names come from a cache
+ * loaded once. KAD_OUT_BINARY writes records instead of lines: the k-mer
+ * (uint64), the number of counts (uint16) and the counts (uint16 sample
+ * id, uint16 count), little-endian. When kad is built with zstd (make
+ * ZSTD=1), the full buffers can be compressed and written by a background
+ * thread. The threads of kad_parallel_scan() format their slices in
+ * outputs kept in memory (see kad_out_init_slice()) */
+typedef struct {
+  int format;
+  vector<char> buf;
+  size_t len;
+  vector<string> names;  // sample names by id
+  vector<float> values;
+  int compress;
+  int grow;              // the buffer grows instead of being flushed
+  thread writer;         // compresses and writes the pending buffers
+  mutex m;
+  condition_variable cv;
+  vector<char> pending;
+  int has_pending, closed;
+} kad_out_t;
+
+static char kad_out_bases[256][4];
+static char kad_out_digits[200];
+
+static void kad_out_write(const char* data, size_t len) {
+  while(len > 0) {
+    ssize_t n = write(STDOUT_FILENO, data, len);
+    if(n < 0 && errno == EINTR)
+      continue;
+    if(n < 0) {
+      perror("Failed to write the output");
+      exit(1);
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+#ifdef KAD_ZSTD
+static void kad_out_compress(kad_out_t* out) {
+  ZSTD_CCtx* cctx = ZSTD_createCCtx();
+  vector<char> zbuf(ZSTD_CStreamOutSize()), data;
+  for (;;) {
+    int closed;
+    {
+      unique_lock<mutex> lock(out->m);
+      out->cv.wait(lock, [&] { return out->has_pending || out->closed; });
+      data.swap(out->pending);
+      closed = out->closed && !out->has_pending;
+      out->has_pending = 0;
+      out->cv.notify_all();
+    }
+    ZSTD_inBuffer in = { data.data(), closed ? 0 : data.size(), 0 };
+    ZSTD_EndDirective mode = closed ? ZSTD_e_end : ZSTD_e_continue;
+    size_t left;
+    do {
+      ZSTD_outBuffer zout = { zbuf.data(), zbuf.size(), 0 };
+      left = ZSTD_compressStream2(cctx, &zout, &in, mode);
+      if(ZSTD_isError(left)) {
+        cerr << "Failed to compress the output: " << ZSTD_getErrorName(left) << endl;
+        exit(1);
+      }
+      kad_out_write(zbuf.data(), zout.pos);
+    } while(closed ? left > 0 : in.pos < in.size);
+    if(closed)
+      break;
+  }
+  ZSTD_freeCCtx(cctx);
+}
+#endif
+
+void kad_out_init(kad_out_t* out, kad_db_t* db, int format, int compress) {
+  for (int b = 0; b < 256; b++) {
+    for (int i = 0; i < 4; i++)
+      kad_out_bases[b][i] = NUCLEOTIDES[(b >> (6 - 2*i)) & 3];
+  }
+  for (int i = 0; i < 100; i++) {
+    kad_out_digits[2*i] = '0' + i / 10;
+    kad_out_digits[2*i + 1] = '0' + i % 10;
+  }
+  out->format = format;
+  out->buf.resize(KAD_OUT_BUFFER);
+  out->len = 0;
+  out->names.assign(UINT16_MAX + 1, string());
+  for (uint32_t id = 0; id < kad_nb_samples(db); id++)
+    out->names[id] = sample_name_of(db, id);
+
+  out->compress = compress;
+  out->grow = 0;
+  out->has_pending = out->closed = 0;
+#ifdef KAD_ZSTD
+  if(compress)
+    out->writer = thread(kad_out_compress, out);
+#else
+  if(compress) {
+    cerr << "kad was built without zstd (make ZSTD=1)" << endl;
+    exit(1);
+  }
+#endif
+}
+
+/* An output in memory with the format and sample names of out, or with
+ * none when out is NULL. Its buffer is moved to out by the caller */
+void kad_out_init_slice(kad_out_t* slice, const kad_out_t* out) {
+  slice->format = out ? out->format : KAD_OUT_TSV;
+  slice->len = 0;
+  if(out)
+    slice->names = out->names;
+  slice->compress = 0;
+  slice->grow = 1;
+  slice->has_pending = slice->closed = 0;
+}
+
+void kad_out_flush(kad_out_t* out) {
+  if(!out->compress) {
+    kad_out_write(out->buf.data(), out->len);
+    out->len = 0;
+    return;
+  }
+  // The buffer is swapped with the one the writer is done with
+  unique_lock<mutex> lock(out->m);
+  out->cv.wait(lock, [&] { return !out->has_pending; });
+  out->buf.resize(out->len);
+  out->buf.swap(out->pending);
+  out->buf.resize(KAD_OUT_BUFFER);
+  out->has_pending = 1;
+  out->len = 0;
+  out->cv.notify_all();
+}
+
+void kad_out_close(kad_out_t* out) {
+  kad_out_flush(out);
+  if(out->compress) {
+    {
+      unique_lock<mutex> lock(out->m);
+      out->closed = 1;
+      out->cv.notify_all();
+    }
+    out->writer.join();
+  }
+}
+
+/* Room for n more bytes in the buffer */
+static inline char* kad_out_reserve(kad_out_t* out, size_t n) {
+  if(out->len + n > out->buf.size()) {
+    if(!out->grow)
+      kad_out_flush(out);
+    if(out->len + n > out->buf.size())
+      out->buf.resize(max(out->len + n, 2 * out->buf.size()));
+  }
+  return out->buf.data() + out->len;
+}
+
+static inline void kad_out_char(kad_out_t* out, char c) {
+  *kad_out_reserve(out, 1) = c;
+  out->len++;
+}
+
+static inline void kad_out_str(kad_out_t* out, const char* s, size_t len) {
+  memcpy(kad_out_reserve(out, len), s, len);
+  out->len += len;
+}
+
+static inline void kad_out_kmer(kad_out_t* out, uint64_t kmer) {
+  char* p = kad_out_reserve(out, KMER_LENGTH);
+  for (int i = 0; i < KMER_LENGTH / 4; i++)
+    memcpy(p + 4*i, kad_out_bases[(kmer >> (8 * (KMER_LENGTH / 4 - 1 - i))) & 0xFF], 4);
+  out->len += KMER_LENGTH;
+}
+
+static inline void kad_out_uint(kad_out_t* out, uint64_t v) {
+  char tmp[20];
+  char* q = tmp + sizeof(tmp);
+  while(v >= 100) {
+    q -= 2;
+    memcpy(q, kad_out_digits + 2 * (v % 100), 2);
+    v /= 100;
+  }
+  if(v >= 10) {
+    q -= 2;
+    memcpy(q, kad_out_digits + 2 * v, 2);
+  } else {
+    *--q = '0' + v;
+  }
+  kad_out_str(out, q, tmp + sizeof(tmp) - q);
+}
+
+/* The counts of a k-mer as name|count separated by tabs, normalized when
+ * scale is not empty. With a filter, only the samples of its set */
+void kad_out_counts(kad_out_t* out, const count_t* counts, size_t nb_counts, const vector<float>& scale,
+    const kad_filter_t* filter) {
+  if(!scale.empty()) {
+    out->values.resize(nb_counts);
+    scale_counts(counts, nb_counts, scale.data(), out->values.data());
+  }
+  size_t n = 0;
+  for (size_t i = 0; i < nb_counts; i++) {
+    if(filter && !kad_filter_in_set(filter, counts[i].id))
+      continue;
+    if(n++ > 0)
+      kad_out_char(out, '\t');
+    const string& name = out->names[counts[i].id];
+    kad_out_str(out, name.data(), name.size());
+    kad_out_char(out, '|');
+    if(scale.empty()) {
+      kad_out_uint(out, counts[i].n);
+    } else {
+      char buf[32];
+      kad_out_str(out, buf, snprintf(buf, sizeof(buf), "%.2f", out->values[i]));
+    }
+  }
+}
+
+/* A binary record, with the counts of the samples of the set of filter */
+void kad_out_record(kad_out_t* out, uint64_t kmer, const count_t* counts, size_t nb_counts,
+    const kad_filter_t* filter) {
+  uint16_t n = 0;
+  for (size_t i = 0; i < nb_counts; i++)
+    n += !filter || kad_filter_in_set(filter, counts[i].id);
+  kad_out_str(out, (const char*)&kmer, sizeof(kmer));
+  kad_out_str(out, (const char*)&n, sizeof(n));
+  for (size_t i = 0; i < nb_counts; i++) {
+    if(!filter || kad_filter_in_set(filter, counts[i].id))
+      kad_out_str(out, (const char*)&counts[i], sizeof(count_t));
+  }
+}
+
+/* Scan the counts database with nb_threads threads. The key space is cut in
+ * KAD_SCAN_SLICES_PER_THREAD slices per thread, and for every k-mer of a
+ * slice f(thread, kmer, counts, nb_counts, slice_out) is called, where
+ * slice_out is the output of the slice in memory. The slices are written to
+ * out in key order, so the output is the same as a sequential scan. out may
+ * be NULL when f writes nothing */
+template <typename F>
+void kad_parallel_scan(kad_db_t* db, int nb_threads, kad_out_t* out, F f) {
+  size_t nb_slices = nb_threads * KAD_SCAN_SLICES_PER_THREAD;
+  uint64_t step = UINT64_MAX / nb_slices + 1;
+  vector< vector<char> > outputs(nb_slices);
+  vector<char> done(nb_slices, 0);
+  size_t next_slice = 0, nb_printed = 0;
+  mutex m;
+  condition_variable cv;
+
+  auto worker = [&](int thread) {
+    kad_out_t slice_out;
+    kad_out_init_slice(&slice_out, out);
+    for (;;) {
+      size_t slice;
+      {
+        // Do not get too far ahead of the output
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return next_slice < nb_printed + 4 * nb_threads; });
+        if(next_slice >= nb_slices)
+          return;
+        slice = next_slice++;
+      }
+
+      uint64_t first = slice * step;
+      uint64_t last = slice + 1 < nb_slices ? first + step - 1 : UINT64_MAX;
+      kad_check(kad_scan(db, first, last, [&](uint64_t kmer, const count_t* counts, size_t nb_counts) {
+        f(thread, kmer, counts, nb_counts, &slice_out);
+      }), 4);
+
+      slice_out.buf.resize(slice_out.len);
+      slice_out.len = 0;
+      unique_lock<mutex> lock(m);
+      outputs[slice].swap(slice_out.buf);
+      done[slice] = 1;
+      cv.notify_all();
+    }
+  };
+
+  vector<thread> threads;
+  for (int i = 0; i < nb_threads; i++)
+    threads.push_back(thread(worker, i));
+
+  for (size_t slice = 0; slice < nb_slices; slice++) {
+    vector<char> slice_buf;
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [&] { return done[slice] != 0; });
+      slice_buf.swap(outputs[slice]);
+      nb_printed++;
+      cv.notify_all();
+    }
+    if(out)
+      kad_out_str(out, slice_buf.data(), slice_buf.size());
+  }
+
+  for (int i = 0; i < nb_threads; i++)
+    threads[i].join();
+}
+
+int kad_test(kad_db_t* db, int argc, char **argv) {
+  //char kmer[33] = "AGAGGAGGGACGGGCTGAAAAAGTACTCATTG";
+  return 0;
+}
+
+int kad_info(kad_db_t* db, int argc, char **argv) {
+  int c, deep = 0, help = 0, nb_threads = 1;
+  static struct option long_options[] = {
+    { "deep",    no_argument,       0, 'd' },
+    { "threads", required_argument, 0, 't' },
+    { "help",    no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hdt:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'd': deep = 1; break;
+      case 't': nb_threads = max(atoi(optarg), 1); break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad info [options]\n\n");
+    fprintf(stderr, "Options: -d, --deep         scan the whole database to compute the histograms,\n");
+    fprintf(stderr, "                            also for the samples indexed by an older kad\n");
+    fprintf(stderr, "         -t, --threads INT  number of threads of the scan [1]\n");
+    fprintf(stderr, "         -h, --help         print this help message\n");
+		return 1;
+  }
+
+  string nb_kmers;
+  db->counts_db->GetProperty("rocksdb.estimate-num-keys", &nb_kmers);
+  cerr << "Nb kmers:   " << nb_kmers << endl;
+  cerr << "Nb samples: " << kad_nb_samples(db) << endl;
+  cerr << "Format:     " << db->header.format_version << ", " << db->header.k << "-mers, "
+    << (db->layout == KAD_LAYOUT_MINIMIZER ? "minimizer" : "kmer") << " layout" << endl;
+
+  kad_stats_t stats;
+  size_t nb_samples = kad_nb_samples(db);
+  vector<sample_hist_t> hists(nb_samples);
+  vector<char> has_hist(nb_samples, 0);
+  if(!deep) {
+    if(kad_load_stats(db, &stats))
+      print_stats(&stats);
+    for (size_t id = 0; id < nb_samples; id++)
+      has_hist[id] = get_sample_hist(db, id, &hists[id]);
+    print_sample_hists(db, hists, has_hist);
+    return 0;
+  }
+
+  // Every thread fills its own histograms, they are merged at the end. The
+  // counts of samples added after the samples were loaded are left out
+  vector<kad_stats_t> thread_stats(nb_threads);
+  vector< vector<sample_hist_t> > thread_hists(nb_threads);
+  for (int i = 0; i < nb_threads; i++) {
+    kad_stats_init(&thread_stats[i]);
+    thread_hists[i].resize(nb_samples);
+    memset(thread_hists[i].data(), 0, nb_samples * sizeof(sample_hist_t));
+  }
+
+  kad_parallel_scan(db, nb_threads, NULL,
+      [&](int thread, uint64_t kmer, const count_t* counts, size_t nb_counts, kad_out_t* out) {
+    kad_stats_t* stats = &thread_stats[thread];
+    sample_hist_t* sample_hists = thread_hists[thread].data();
+    kad_stats_move(stats, 0, nb_counts);
+    for (size_t i = 0; i < nb_counts; i++) {
+      int b = count_bucket(counts[i].n);
+      stats->count_hist[b]++;
+      if(counts[i].id < nb_samples)
+        sample_hists[counts[i].id].count_hist[b]++;
+    }
+  });
+
+  kad_stats_init(&stats);
+  memset(hists.data(), 0, nb_samples * sizeof(sample_hist_t));
+  has_hist.assign(nb_samples, 1);
+  for (int i = 0; i < nb_threads; i++) {
+    kad_stats_merge(&stats, &thread_stats[i]);
+    for (size_t id = 0; id < nb_samples; id++) {
+      for (size_t b = 0; b < KAD_COUNT_BUCKETS; b++)
+        hists[id].count_hist[b] += thread_hists[i][id].count_hist[b];
+    }
+  }
+
+  int64_t nb_kmers_scanned = 0;
+  for (size_t i = 1; i < stats.support.size(); i++)
+    nb_kmers_scanned += stats.support[i];
+  cout << "# Nb kmers (scanned)\t" << nb_kmers_scanned << endl;
+  print_stats(&stats);
+  print_sample_hists(db, hists, has_hist);
+  return 0;
+}
+
+/* Name of a KAD_SAMPLE_STATUS */
+const char* sample_status_name(uint32_t status) {
+  switch(status) {
+    case KAD_SAMPLE_INDEXING: return "indexing";
+    case KAD_SAMPLE_COMPLETE: return "complete";
+    case KAD_SAMPLE_NO_TOTALS: return "no-totals";
+  }
+  return "unknown";
+}
+
+int kad_samples(kad_db_t* db, int argc, char **argv) {
+  int c, help = 0, long_format = 0;
+  static struct option long_options[] = {
+    { "long", no_argument, 0, 'l' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hl", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'l': long_format = 1; break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad samples [options]\n\n");
+    fprintf(stderr, "Options: -l, --long  print the status and creation time of every sample:\n");
+    fprintf(stderr, "                     id, name, status, created, nb kmers, total count\n");
+    fprintf(stderr, "         -h, --help  print this help message\n");
+		return 1;
+  }
+
+  for (uint32_t id = 0; id < kad_nb_samples(db); id++) {
+    kad_sample_info_t info;
+    kad_progress_t progress;
+    kad_sample_info(db, id, &info);
+    cout << id << "\t" << sample_name_of(db, id);
+    if(long_format) {
+      char created[32] = "-";
+      time_t ctime = info.ctime;
+      if(ctime)
+        strftime(created, sizeof(created), "%Y-%m-%dT%H:%M:%SZ", gmtime(&ctime));
+      cout << "\t" << sample_status_name(info.status) << "\t" << created;
+      if(info.status == KAD_SAMPLE_COMPLETE)
+        cout << "\t" << info.nb_kmers << "\t" << info.total_count;
+      else
+        cout << "\t-\t-";
+    } else if(kad_sample_progress(db, id, &progress)) {
+      cout << "\tincomplete\t" << progress.nb_kmers << " kmers, byte " << progress.offset;
+    } else if(info.status == KAD_SAMPLE_COMPLETE) {
+      cout << "\t" << info.nb_kmers << "\t" << info.total_count;
+    }
+    cout << endl;
+  }
+  return 0;
+}
+
+int kad_dump(kad_db_t* db, int argc, char **argv)
+{
+  int c, show_counts = 1, help = 0, normalize = KAD_NORMALIZE_NONE, format = KAD_OUT_TSV, compress = 0;
+  char *samples_list = NULL;
+  kad_filter_t filter;
+  kad_filter_init(&filter);
+  int min_support_in_set = -1;
+
+  static struct option long_options[] = {
+    { "samples",            required_argument, 0, 's' },
+    { "min-count",          required_argument, 0, 'c' },
+    { "min-support-in-set", required_argument, 0, 'S' },
+    { "normalize",          required_argument, 0, 'N' },
+    { "format",             required_argument, 0, 'F' },
+    { "zstd",               no_argument,       0, 'z' },
+    { "help",               no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hnzm:M:s:c:S:N:F:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'F': format = parse_output_format(optarg); break;
+      case 'z': compress = 1; break;
+      case 'n': show_counts = 0; break;
+      case 'h': help = 1; break;
+      case 'm': filter.min_support = atoi(optarg); break;
+      case 'M': filter.max_support = atoi(optarg); break;
+      case 's': samples_list = optarg; break;
+      case 'c': filter.min_count = min(atoi(optarg), UINT16_MAX); break;
+      case 'S': min_support_in_set = atoi(optarg); break;
+      case 'N': normalize = parse_normalize(optarg); break;
+    }
+  }
+
+  if (help) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad dump\n\n");
+    fprintf(stderr, "Options: -n      only output k-mers\n");
+    fprintf(stderr, "         -h      print this help message\n");
+    fprintf(stderr, "         -m INT  min number of supported samples\n");
+    fprintf(stderr, "         -M INT  max number of supported samples\n");
+    fprintf(stderr, "         -s, --samples LIST            comma-separated set of samples, only their\n");
+    fprintf(stderr, "                                       counts are printed\n");
+    fprintf(stderr, "         -c, --min-count INT           min count for a sample to support a k-mer\n");
+    fprintf(stderr, "         -S, --min-support-in-set INT  min number of supporting samples of the set\n");
+    fprintf(stderr, "                                       (default: all the samples of the set)\n");
+    fprintf(stderr, "         -N, --normalize cpm|none      print counts per million [none]\n");
+    fprintf(stderr, "         -F, --format tsv|binary       output lines or binary records (see README) [tsv]\n");
+    fprintf(stderr, "         -z, --zstd                    compress the output with zstd\n");
+		return 1;
+  }
+  if(format == KAD_OUT_BINARY && normalize != KAD_NORMALIZE_NONE) {
+    cerr << "The binary records only hold raw counts" << endl;
+    return 1;
+  }
+
+  vector<float> scale;
+  load_sample_scale(db, normalize, scale);
+
+  if(samples_list)
+    kad_filter_set_samples(db, &filter, samples_list);
+  if(min_support_in_set >= 0) {
+    if(samples_list && (size_t)min_support_in_set > filter.set_size) {
+      cerr << "The set only has " << filter.set_size << " samples" << endl;
+      return 1;
+    }
+    filter.min_support_in_set = min_support_in_set;
+  }
+
+  kad_out_t out;
+  kad_out_init(&out, db, format, compress);
+  const kad_filter_t* set = filter.set_size > 0 ? &filter : NULL;
+  kad_check(kad_scan(db, 0, UINT64_MAX, [&](uint64_t kmer, const count_t* counts, size_t nb_counts) {
+    if(!kad_filter_match(&filter, counts, nb_counts))
+      return;
+
+    if(format == KAD_OUT_BINARY) {
+      kad_out_record(&out, kmer, counts, show_counts ? nb_counts : 0, set);
+      return;
+    }
+    kad_out_kmer(&out, kmer);
+    if(show_counts) {
+      kad_out_char(&out, '\t');
+      kad_out_counts(&out, counts, nb_counts, scale, set);
+    }
+    kad_out_char(&out, '\n');
+  }), 4);
+  kad_out_close(&out);
+  return 0;
+}
+
+/* Read a list of sample names, one per line, and mark their ids with group
+ * in groups. Returns the number of sample ids of the group, a name indexed
+ * several times has several ids */
+size_t kad_read_group(kad_db_t* db, const char* file, int8_t group, vector<int8_t>& groups) {
+  gzFile fp = gzopen(file, "r");
+  if(!fp) { fprintf(stderr, "Failed to open %s\n", file); exit(EXIT_FAILURE); }
+  kstream_t *ks = ks_init(fp);
+  kstring_t *str = (kstring_t*)calloc(1, sizeof(kstring_t));
+  int dret;
+  size_t nb_samples = 0;
+  while (ks_getuntil(ks, KS_SEP_LINE, str, &dret) >= 0) {
+    if(str->l == 0) continue;
+    vector<uint16_t> ids;
+    if(kad_sample_ids(db, str->s, ids) == 0) {
+      cerr << "Unknown sample: " << str->s << endl;
+      exit(1);
+    }
+    for (size_t i = 0; i < ids.size(); i++) {
+      if(groups[ids[i]] >= 0 && groups[ids[i]] != group) {
+        cerr << "Sample " << str->s << " is in both groups" << endl;
+        exit(1);
+      }
+      nb_samples += groups[ids[i]] != group;
+      groups[ids[i]] = group;
+    }
+  }
+  ks_destroy(ks);
+  gzclose(fp);
+  free(str->s); free(str);
+  return nb_samples;
+}
+
+int kad_diff(kad_db_t* db, int argc, char **argv)
+{
+  int c, help = 0, nb_threads = 1, normalize = KAD_NORMALIZE_NONE, compress = 0;
+  char *group_files[2] = { NULL, NULL };
+  int min_support[2] = { 1, 0 }, max_support[2] = { INT_MAX, INT_MAX };
+  uint16_t min_count = 1;
+  double min_fold = 0;
+
+  static struct option long_options[] = {
+    { "group-a",       required_argument, 0, 'a' },
+    { "group-b",       required_argument, 0, 'b' },
+    { "min-support-a", required_argument, 0, 1 },
+    { "max-support-a", required_argument, 0, 2 },
+    { "min-support-b", required_argument, 0, 3 },
+    { "max-support-b", required_argument, 0, 4 },
+    { "min-count",     required_argument, 0, 'c' },
+    { "min-fold",      required_argument, 0, 'f' },
+    { "threads",       required_argument, 0, 't' },
+    { "normalize",     required_argument, 0, 'N' },
+    { "zstd",          no_argument,       0, 'z' },
+    { "help",          no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "ha:b:c:f:t:N:z", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'a': group_files[0] = optarg; break;
+      case 'b': group_files[1] = optarg; break;
+      case 1: min_support[0] = atoi(optarg); break;
+      case 2: max_support[0] = atoi(optarg); break;
+      case 3: min_support[1] = atoi(optarg); break;
+      case 4: max_support[1] = atoi(optarg); break;
+      case 'c': min_count = min(atoi(optarg), UINT16_MAX); break;
+      case 'f': min_fold = atof(optarg); break;
+      case 't': nb_threads = max(atoi(optarg), 1); break;
+      case 'N': normalize = parse_normalize(optarg); break;
+      case 'z': compress = 1; break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || !group_files[0] || !group_files[1]) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad diff [options] --group-a a.list --group-b b.list\n\n");
+    fprintf(stderr, "Options: -a, --group-a FILE      samples of group A, one per line\n");
+    fprintf(stderr, "         -b, --group-b FILE      samples of group B, one per line\n");
+    fprintf(stderr, "         --min-support-a INT     min number of samples of A supporting the k-mer [1]\n");
+    fprintf(stderr, "         --max-support-a INT     max number of samples of A supporting the k-mer\n");
+    fprintf(stderr, "         --min-support-b INT     min number of samples of B supporting the k-mer [0]\n");
+    fprintf(stderr, "         --max-support-b INT     max number of samples of B supporting the k-mer\n");
+    fprintf(stderr, "         -c, --min-count INT     min count for a sample to support a k-mer [1]\n");
+    fprintf(stderr, "         -f, --min-fold FLOAT    min fold change between the mean counts of A and B,\n");
+    fprintf(stderr, "                                 in either direction (|log2 fold| >= log2 FLOAT)\n");
+    fprintf(stderr, "         -t, --threads INT       number of threads [1]\n");
+    fprintf(stderr, "         -N, --normalize STR     cpm: compare counts per million, none: raw counts [none]\n");
+    fprintf(stderr, "         -z, --zstd              compress the output with zstd\n");
+    fprintf(stderr, "         -h, --help              print this help message\n\n");
+    fprintf(stderr, "Output:  k-mer, support in A, support in B, mean count in A, mean count in B,\n");
+    fprintf(stderr, "         log2 fold change ((mean A + 1) / (mean B + 1)). These are statistics\n");
+    fprintf(stderr, "         and not counts, so there is no binary format\n");
+		return 1;
+  }
+
+  vector<int8_t> groups(UINT16_MAX + 1, -1);
+  size_t group_sizes[2];
+  group_sizes[0] = kad_read_group(db, group_files[0], 0, groups);
+  group_sizes[1] = kad_read_group(db, group_files[1], 1, groups);
+  for (int g = 0; g < 2; g++) {
+    if(group_sizes[g] == 0) {
+      cerr << "No sample in the group file " << group_files[g] << endl;
+      return 1;
+    }
+  }
+
+  vector<float> scale;
+  load_sample_scale(db, normalize, scale);
+
+  // The fold is tested in both directions, so that the k-mers depleted in A
+  // are kept as well as the enriched ones
+  double log2_min_fold = min_fold > 0 ? log2(min_fold) : -INFINITY;
+
+  kad_out_t out;
+  kad_out_init(&out, db, KAD_OUT_TSV, compress);
+  kad_parallel_scan(db, nb_threads, &out,
+      [&](int thread, uint64_t kmer, const count_t* counts, size_t nb_counts, kad_out_t* slice_out) {
+    int support[2] = { 0, 0 };
+    double sum[2] = { 0, 0 };
+    for (size_t i = 0; i < nb_counts; i++) {
+      int8_t g = groups[counts[i].id];
+      if(g < 0) continue;
+      sum[g] += scale.empty() ? counts[i].n : counts[i].n * scale[counts[i].id];
+      support[g] += counts[i].n >= min_count;
+    }
+    if(support[0] < min_support[0] || support[0] > max_support[0]
+        || support[1] < min_support[1] || support[1] > max_support[1])
+      return;
+
+    double mean_a = sum[0] / group_sizes[0];
+    double mean_b = sum[1] / group_sizes[1];
+    double log2_fold = log2((mean_a + 1) / (mean_b + 1));
+    if(fabs(log2_fold) < log2_min_fold)
+      return;
+
+    char line[128];
+    int l = snprintf(line, sizeof(line), "\t%d\t%d\t%.2f\t%.2f\t%.3f\n",
+        support[0], support[1], mean_a, mean_b, log2_fold);
+    kad_out_kmer(slice_out, kmer);
+    kad_out_str(slice_out, line, l);
+  });
+  kad_out_close(&out);
+
+  return 0;
+}
+
+enum KAD_TOP_BY { KAD_TOP_TOTAL, KAD_TOP_SUPPORT, KAD_TOP_SAMPLE };
+
+typedef struct {
+  uint64_t score;
+  uint64_t kmer;
+} top_entry_t;
+
+/* Higher score first, and smaller k-mer first on ties so that the result
+ * does not depend on the number of threads */
+static inline bool top_better(const top_entry_t& a, const top_entry_t& b) {
+  return a.score > b.score || (a.score == b.score && a.kmer < b.kmer);
+}
+
+/* Keep the n best entries in a heap whose top is the worst one */
+static inline void top_push(vector<top_entry_t>& heap, size_t n, const top_entry_t& e) {
+  if(heap.size() < n) {
+    heap.push_back(e);
+    push_heap(heap.begin(), heap.end(), top_better);
+  } else if(top_better(e, heap.front())) {
+    pop_heap(heap.begin(), heap.end(), top_better);
+    heap.back() = e;
+    push_heap(heap.begin(), heap.end(), top_better);
+  }
+}
+
+int kad_top(kad_db_t* db, int argc, char **argv)
+{
+  int c, help = 0, nb_threads = 1, show_counts = 1, by = KAD_TOP_TOTAL;
+  int format = KAD_OUT_TSV, compress = 0;
+  size_t n = 10;
+  const char* sample_name = NULL;
+  static struct option long_options[] = {
+    { "number",  required_argument, 0, 'n' },
+    { "by",      required_argument, 0, 'b' },
+    { "threads", required_argument, 0, 't' },
+    { "format",  required_argument, 0, 'F' },
+    { "zstd",    no_argument,       0, 'z' },
+    { "help",    no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hkn:b:t:F:z", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'n': n = strtoull(optarg, NULL, 10); break;
+      case 'b':
+        if(strcmp(optarg, "total") == 0) by = KAD_TOP_TOTAL;
+        else if(strcmp(optarg, "support") == 0) by = KAD_TOP_SUPPORT;
+        else if(strncmp(optarg, "sample=", 7) == 0) { by = KAD_TOP_SAMPLE; sample_name = optarg + 7; }
+        else help = 1;
+        break;
+      case 'k': show_counts = 0; break;
+      case 't': nb_threads = max(atoi(optarg), 1); break;
+      case 'F': format = parse_output_format(optarg); break;
+      case 'z': compress = 1; break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || n == 0) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad top [options]\n\n");
+    fprintf(stderr, "Options: -n, --number INT   number of k-mers [10]\n");
+    fprintf(stderr, "         -b, --by STR       total: sum of the counts, support: number of samples,\n");
+    fprintf(stderr, "                            sample=NAME: count in the sample NAME [total]\n");
+    fprintf(stderr, "         -k                 only output the k-mers and their scores\n");
+    fprintf(stderr, "         -t, --threads INT  number of threads of the scan [1]\n");
+    fprintf(stderr, "         -F, --format STR   tsv: output lines, binary: records of the k-mers and\n");
+    fprintf(stderr, "                            their counts, best first (see README) [tsv]\n");
+    fprintf(stderr, "         -z, --zstd         compress the output with zstd\n");
+    fprintf(stderr, "         -h, --help         print this help message\n");
+		return 1;
+  }
+  if(format == KAD_OUT_BINARY && !show_counts) {
+    cerr << "The binary records hold the counts, -k cannot be used with them" << endl;
+    return 1;
+  }
+
+  vector<char> in_sample;
+  if(by == KAD_TOP_SAMPLE) {
+    vector<uint16_t> ids;
+    if(kad_sample_ids(db, sample_name, ids) == 0) {
+      cerr << "Unknown sample: " << sample_name << endl;
+      return 1;
+    }
+    in_sample.assign(UINT16_MAX + 1, 0);
+    for (size_t i = 0; i < ids.size(); i++)
+      in_sample[ids[i]] = 1;
+  }
+
+  // Every thread keeps its n best k-mers, the heaps are merged at the end
+  vector< vector<top_entry_t> > heaps(nb_threads);
+  kad_parallel_scan(db, nb_threads, NULL,
+      [&](int thread, uint64_t kmer, const count_t* counts, size_t nb_counts, kad_out_t* out) {
+    top_entry_t e = { 0, kmer };
+    if(by == KAD_TOP_SUPPORT) {
+      e.score = nb_counts;
+    } else {
+      for (size_t i = 0; i < nb_counts; i++) {
+        if(by == KAD_TOP_TOTAL || in_sample[counts[i].id])
+          e.score += counts[i].n;
+      }
+      if(e.score == 0)
+        return;
+    }
+    top_push(heaps[thread], n, e);
+  });
+
+  vector<top_entry_t> top;
+  for (int i = 0; i < nb_threads; i++) {
+    for (size_t j = 0; j < heaps[i].size(); j++)
+      top_push(top, n, heaps[i][j]);
+    vector<top_entry_t>().swap(heaps[i]);
+  }
+  sort(top.begin(), top.end(), top_better);
+
+  // The counts of the selected k-mers are read again with one batch lookup
+  vector<uint64_t> keys(top.size());
+  for (size_t i = 0; i < top.size(); i++)
+    keys[i] = top[i].kmer;
+  sort(keys.begin(), keys.end());
+  kad_batch_t batch;
+  if(show_counts)
+    kad_check(kad_multi_get(db, &batch, keys.size(), keys.data()), 4);
+
+  kad_out_t out;
+  kad_out_init(&out, db, format, compress);
+  vector<float> scale;
+  for (size_t i = 0; i < top.size(); i++) {
+    size_t k = show_counts ? lower_bound(keys.begin(), keys.end(), top[i].kmer) - keys.begin() : 0;
+    if(format == KAD_OUT_BINARY) {
+      kad_out_record(&out, top[i].kmer, batch.counts[k], batch.nb_counts[k], NULL);
+      continue;
+    }
+    kad_out_kmer(&out, top[i].kmer);
+    kad_out_char(&out, '\t');
+    kad_out_uint(&out, top[i].score);
+    if(show_counts) {
+      kad_out_char(&out, '\t');
+      kad_out_counts(&out, batch.counts[k], batch.nb_counts[k], scale, NULL);
+    }
+    kad_out_char(&out, '\n');
+  }
+  kad_out_close(&out);
+  return 0;
+}
+
+uint64_t rand_uint64(void) {
+  uint64_t r = 0;
+  for (int i=0; i<64; i += 30) {
+    r = r*(RAND_MAX + (uint64_t)1) + rand();
+  }
+  return r;
+}
+
+/* Keys looked up together by the queries. A batch lookup may pin one block
+ * per key, so the batches are sized to fit in the ingest share of the
+ * memory budget (see kad_ingest_bytes()), with at most BUFFER_SIZE keys */
+size_t kad_query_batch(kad_db_t* db) {
+  size_t n = kad_ingest_bytes(db, KAD_QUERY_BYTES) / KAD_QUERY_BLOCK_BYTES;
+  return max(min(n, (size_t)BUFFER_SIZE), (size_t)KAD_QUERY_MIN_BATCH);
+}
+
+/* Benchmark of the lookups, with the backend chosen by --in-memory */
+int kad_random_query(kad_db_t* db, int argc, char **argv) {
+
+  int c, help = 0, hits = 0, cold = 0, read_length = 0;
+  size_t batch_size = 1;
+  static struct option long_options[] = {
+    { "batch", required_argument, 0, 'b' },
+    { "reads", required_argument, 0, 'r' },
+    { "hits",  no_argument,       0, 'H' },
+    { "cold",  no_argument,       0, 'c' },
+    { "help",  no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hb:r:Hc", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'b': batch_size = max(atoi(optarg), 1); break;
+      case 'r': read_length = max(atoi(optarg), KMER_LENGTH); break;
+      case 'c': cold = 1; break;
+      case 'H': hits = 1; break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || optind >= argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad random_query [options] nb_queries\n\n");
+    fprintf(stderr, "Options: -b, --batch INT  number of k-mers looked up together, at most the batch\n");
+    fprintf(stderr, "                          of kad query under --memory [1]\n");
+    fprintf(stderr, "         -r, --reads INT  look up the k-mers of reads of INT bases together,\n");
+    fprintf(stderr, "                          instead of unrelated k-mers (with -H, the reads follow\n");
+    fprintf(stderr, "                          k-mers of the database)\n");
+    fprintf(stderr, "         -H, --hits       query k-mers of the database instead of random k-mers\n");
+    fprintf(stderr, "                          (they are sampled with a scan before the timing)\n");
+    fprintf(stderr, "         -c, --cold       do not keep the blocks read in the block cache (use it\n");
+    fprintf(stderr, "                          with kad --direct-reads to bypass the page cache too)\n");
+    fprintf(stderr, "         -h, --help       print this help message\n");
+		return 1;
+  }
+
+  size_t nb_queries = atoi(argv[optind]);
+  if(read_length == 0)
+    batch_size = min(batch_size, kad_query_batch(db));
+
+  // Reservoir sample of the k-mers of the database
+  vector<uint64_t> sample;
+  if(hits) {
+    size_t nb_kmers = 0;
+    kad_check(kad_scan(db, 0, UINT64_MAX, [&](uint64_t kmer, const count_t* counts, size_t nb_counts) {
+      uint64_t r = rand_uint64() % (nb_kmers + 1);
+      if(sample.size() < nb_queries)
+        sample.push_back(kmer);
+      else if(r < nb_queries)
+        sample[r] = kmer;
+      nb_kmers++;
+    }), 4);
+    if(sample.empty()) {
+      cerr << "The database is empty" << endl;
+      return 1;
+    }
+  }
+
+  kad_batch_t batch;
+  vector<uint64_t> keys;
+
+  // The k-mers of the reads are built before the timing: each read starts
+  // at a sampled k-mer and is extended one base at a time, following the
+  // k-mers of the database when there is one
+  vector<uint64_t> reads;
+  if(read_length > 0) {
+    batch_size = read_length - KMER_LENGTH + 1;
+    for (size_t i = 0; i < nb_queries; i += batch_size) {
+      uint64_t kmer = hits ? sample[(i / batch_size) % sample.size()] : rand_uint64();
+      reads.push_back(kmer);
+      for (size_t j = 1; j < batch_size && i + j < nb_queries; j++) {
+        uint64_t next[4];
+        for (int b = 0; b < 4; b++)
+          next[b] = (kmer << 2) | b;
+        uint64_t r = rand_uint64();
+        kmer = next[r & 3];
+        if(hits) {
+          kad_check(kad_multi_get(db, &batch, 4, next), 4);
+          for (int b = 0; b < 4; b++) {
+            if(batch.counts[(b + r) & 3]) {
+              kmer = next[(b + r) & 3];
+              break;
+            }
+          }
+        }
+        reads.push_back(kmer);
+      }
+    }
+  }
+
+  if(cold)
+    db->io_flags |= KAD_NO_FILL_CACHE;
+
+  rocksdb::SetPerfLevel(rocksdb::PerfLevel::kEnableCount);
+  rocksdb::get_perf_context()->Reset();
+  size_t nb_found = 0, nb_batches = 0;
+  double start = kad_realtime();
+  for(size_t i = 0; i < nb_queries; i += batch_size) {
+    if(i % BUFFER_SIZE < batch_size)
+      kad_follow(db);
+    keys.clear();
+    for (size_t j = i; j < min(i + batch_size, nb_queries); j++)
+      keys.push_back(read_length > 0 ? reads[j] : hits ? sample[j % sample.size()] : rand_uint64());
+    sort(keys.begin(), keys.end());
+    kad_check(kad_multi_get(db, &batch, keys.size(), keys.data()), 4);
+    for (size_t j = 0; j < keys.size(); j++)
+      nb_found += batch.counts[j] != NULL;
+    nb_batches++;
+  }
+  double elapsed = kad_realtime() - start;
+  rocksdb::PerfContext* perf = rocksdb::get_perf_context();
+  rocksdb::SetPerfLevel(rocksdb::PerfLevel::kDisable);
+
+  const char* io = db->io_flags & KAD_SYNC_IO ? "sync" : "async";
+  const char* layout = db->layout == KAD_LAYOUT_MINIMIZER ? "minimizer" : "kmer";
+  fprintf(stderr, "%s backend (%s keys, %s io%s%s, batch %zu): %zu queries (%zu found) in %.2f s, %.0f queries/s\n",
+      db->backend->name, layout, io, db->io_flags & KAD_DIRECT_READS ? ", direct reads" : "",
+      cold ? ", cold" : "", batch_size, nb_queries, nb_found, elapsed, nb_queries / max(elapsed, 1e-9));
+  if(db->backend == &kad_rocksdb_backend) {
+    fprintf(stderr, "%.1f blocks per batch (%.1f from the block cache, %.1f read)\n",
+        (double)(perf->block_cache_hit_count + perf->block_read_count) / max(nb_batches, (size_t)1),
+        (double)perf->block_cache_hit_count / max(nb_batches, (size_t)1),
+        (double)perf->block_read_count / max(nb_batches, (size_t)1));
+  }
+  return 0;
+}
+
+/* A neighbor key generated from one probe, with the probe it comes from */
+typedef struct {
+  uint64_t kmer;
+  uint32_t probe;
+} neighbor_t;
+
+bool neighbor_lt(const neighbor_t& a, const neighbor_t& b) {
+  return a.kmer < b.kmer || (a.kmer == b.kmer && a.probe < b.probe);
+}
+
+int is_valid_kmer(const char* str, size_t l) {
+  if(l != KMER_LENGTH) return 0;
+  for (size_t i = 0; i < l; i++) {
+    if(str[i] != 'A' && str[i] != 'C' && str[i] != 'G' && str[i] != 'T')
+      return 0;
+  }
+  return 1;
+}
+
+/* Number of keys push_neighbors() appends for one probe */
+size_t kad_nb_neighbors(int max_mismatches) {
+  size_t n = 1;
+  if(max_mismatches >= 1)
+    n += 3 * KMER_LENGTH;
+  if(max_mismatches >= 2)
+    n += 9 * KMER_LENGTH * (KMER_LENGTH - 1) / 2;
+  return n;
+}
+
+/* Append all k-mers at hamming distance 1..max_mismatches of kmer (and kmer
+ * itself) by XOR-ing a non-zero 2-bit mask at each base position */
+void push_neighbors(vector<neighbor_t>& neighbors, uint64_t kmer, uint32_t probe, int max_mismatches) {
+  neighbors.push_back({ kmer, probe });
+  for (int i = 0; i < KMER_LENGTH && max_mismatches >= 1; i++) {
+    for (uint64_t x = 1; x < 4; x++) {
+      uint64_t kmer_i = kmer ^ (x << (2*i));
+      neighbors.push_back({ kmer_i, probe });
+      for (int j = i + 1; j < KMER_LENGTH && max_mismatches >= 2; j++) {
+        for (uint64_t y = 1; y < 4; y++) {
+          neighbors.push_back({ kmer_i ^ (y << (2*j)), probe });
+        }
+      }
+    }
+  }
+}
+
+/* Print the 1-based positions of the bases that differ between a and b */
+void print_mismatches(kad_out_t* out, uint64_t a, uint64_t b) {
+  uint64_t diff = a ^ b;
+  int n = 0;
+  for (int i = 0; i < KMER_LENGTH; i++) {
+    if((diff >> (2*(KMER_LENGTH-1-i))) & 3ULL) {
+      if(n++ > 0)
+        kad_out_char(out, ',');
+      kad_out_uint(out, i + 1);
+    }
+  }
+  if(n == 0)
+    kad_out_char(out, '-');
+}
+
+int kad_query(kad_db_t* db, int argc, char **argv) {
+
+  int c, max_mismatches = 0, help = 0, normalize = KAD_NORMALIZE_NONE, approx = 0;
+  int format = KAD_OUT_TSV, compress = 0;
+  uint16_t min_count = 1;
+  char *probes_file = NULL;
+  static struct option long_options[] = {
+    { "mismatches", required_argument, 0, 'd' },
+    { "file",       required_argument, 0, 'f' },
+    { "normalize",  required_argument, 0, 'N' },
+    { "approx",     no_argument,       0, 'a' },
+    { "min-count",  required_argument, 0, 'c' },
+    { "format",     required_argument, 0, 'F' },
+    { "zstd",       no_argument,       0, 'z' },
+    { "help",       no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hazd:f:N:c:F:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'F': format = parse_output_format(optarg); break;
+      case 'z': compress = 1; break;
+      case 'd': max_mismatches = atoi(optarg); break;
+      case 'f': probes_file = optarg; break;
+      case 'N': normalize = parse_normalize(optarg); break;
+      case 'a': approx = 1; break;
+      case 'c': min_count = max(min(atoi(optarg), UINT16_MAX), 1); break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || (optind >= argc && !probes_file) || max_mismatches < 0 || max_mismatches > 2) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad query [options] kmer [kmer ...]\n\n");
+    fprintf(stderr, "Options: -d, --mismatches INT  also report k-mers with up to INT (0-2) mismatches\n");
+    fprintf(stderr, "         -f, --file FILE       read query k-mers from FILE, one per line ('-' for stdin)\n");
+    fprintf(stderr, "         -N, --normalize STR   cpm: print counts per million, none: raw counts [none]\n");
+    fprintf(stderr, "         -c, --min-count INT   only report the k-mers with a count of at least INT in\n");
+    fprintf(stderr, "                               some sample [1]\n");
+    fprintf(stderr, "         -a, --approx          answer from the sketch of the database (see kad sketch):\n");
+    fprintf(stderr, "                               print an upper bound of the count of the k-mer in any\n");
+    fprintf(stderr, "                               sample instead of the counts\n");
+    fprintf(stderr, "         -F, --format STR      tsv: output lines, binary: records of the k-mers found\n");
+    fprintf(stderr, "                               and their counts (see README) [tsv]\n");
+    fprintf(stderr, "         -z, --zstd            compress the output with zstd\n");
+    fprintf(stderr, "         -h, --help            print this help message\n\n");
+    fprintf(stderr, "With -d > 0 each hit is reported as: query, k-mer found, mismatch positions, counts\n");
+		return 1;
+  }
+  if(format == KAD_OUT_BINARY && (normalize != KAD_NORMALIZE_NONE || approx)) {
+    cerr << "The binary records only hold raw counts" << endl;
+    return 1;
+  }
+
+  vector<float> scale;
+  load_sample_scale(db, normalize, scale);
+
+  // Collect the probes from the command line and the batch file
+  vector<uint64_t> probes;
+  for (int i = optind; i < argc; i++) {
+    if(!is_valid_kmer(argv[i], strlen(argv[i]))) {
+      cerr << "Skipping invalid k-mer: " << argv[i] << endl;
+      continue;
+    }
+    probes.push_back(kad_str_to_kmer(argv[i]));
+  }
+
+  if(probes_file) {
+    gzFile fp = strcmp(probes_file, "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(probes_file, "r");
+    if(!fp) { fprintf(stderr, "Failed to open %s\n", probes_file); exit(EXIT_FAILURE); }
+    kstream_t *ks = ks_init(fp);
+    kstring_t *str = (kstring_t*)calloc(1, sizeof(kstring_t));
+    int dret;
+    while (ks_getuntil(ks, KS_SEP_LINE, str, &dret) >= 0) {
+      if(str->l == 0) continue;
+      if(!is_valid_kmer(str->s, str->l)) {
+        cerr << "Skipping invalid k-mer: " << str->s << endl;
+        continue;
+      }
+      probes.push_back(kad_str_to_kmer(str->s));
+    }
+    ks_destroy(ks);
+    gzclose(fp);
+    free(str->s); free(str);
+  }
+
+  // The probes are expanded and looked up in chunks whose neighborhoods fit
+  // in the memory budget, and reported chunk after chunk
+  size_t batch_size = kad_query_batch(db);
+  size_t chunk_size = max(kad_ingest_bytes(db, KAD_QUERY_BYTES)
+      / (kad_nb_neighbors(max_mismatches) * KAD_NEIGHBOR_BYTES), (size_t)1);
+  kad_out_t out;
+  kad_out_init(&out, db, format, compress);
+  vector<neighbor_t> neighbors;
+  vector<uint64_t> keys;
+  vector<string> values;
+  vector<int64_t> found;
+  vector< pair<uint32_t, size_t> > hits; // (probe, key index)
+  kad_batch_t batch;
+  for (size_t first = 0; first < probes.size(); first += chunk_size) {
+    size_t last = min(first + chunk_size, probes.size());
+
+    // Expand every probe into its hamming neighborhood and sort all the keys
+    // so that the chunk is resolved in one ordered sweep of the database
+    neighbors.clear();
+    for (size_t i = first; i < last; i++) {
+      push_neighbors(neighbors, probes[i], i, max_mismatches);
+    }
+    sort(neighbors.begin(), neighbors.end(), neighbor_lt);
+    neighbors.erase(unique(neighbors.begin(), neighbors.end(),
+          [](const neighbor_t& a, const neighbor_t& b) { return a.kmer == b.kmer && a.probe == b.probe; }),
+        neighbors.end());
+
+    keys.clear();
+    for (size_t i = 0; i < neighbors.size(); i++) {
+      if(keys.empty() || keys.back() != neighbors[i].kmer)
+        keys.push_back(neighbors[i].kmer);
+    }
+
+    // Only the values of the keys found are kept
+    values.clear();
+    found.assign(keys.size(), -1);
+    if(approx) {
+      vector<uint16_t> bounds(keys.size());
+      kad_check(kad_approx(db, keys.size(), keys.data(), bounds.data()), 1);
+      for (size_t i = 0; i < keys.size(); i++) {
+        if(bounds[i] >= min_count) {
+          found[i] = values.size();
+          values.push_back(to_string(bounds[i]));
+        }
+      }
+    }
+    for (size_t start = 0; !approx && start < keys.size(); start += batch_size) {
+      size_t n = min(batch_size, keys.size() - start);
+      kad_follow(db);
+      kad_check(kad_multi_get(db, &batch, n, &keys[start]), 4);
+      for (size_t i = 0; i < n; i++) {
+        const count_t* counts = batch.counts[i];
+        if(!counts)
+          continue;
+        size_t k = 0;
+        while(k < batch.nb_counts[i] && counts[k].n < min_count) k++;
+        if(k < batch.nb_counts[i]) {
+          found[start + i] = values.size();
+          values.push_back(string((const char*)counts, batch.nb_counts[i] * sizeof(count_t)));
+        }
+      }
+    }
+
+    // Report the hits grouped by probe, in input order
+    hits.clear();
+    for (size_t i = 0, k = 0; i < neighbors.size(); i++) {
+      while(keys[k] != neighbors[i].kmer) k++;
+      if(found[k] >= 0)
+        hits.push_back(make_pair(neighbors[i].probe, k));
+    }
+    sort(hits.begin(), hits.end());
+
+    for (size_t i = 0; i < hits.size(); i++) {
+      uint64_t probe_int = probes[hits[i].first];
+      uint64_t kmer_int = keys[hits[i].second];
+      const string& value = values[found[hits[i].second]];
+      const count_t *counts = (const count_t*)value.data();
+      size_t nb_counts = value.size() / sizeof(count_t);
+
+      if(format == KAD_OUT_BINARY) {
+        kad_out_record(&out, kmer_int, counts, nb_counts, NULL);
+        continue;
+      }
+      kad_out_kmer(&out, probe_int);
+      kad_out_char(&out, '\t');
+      if(max_mismatches > 0) {
+        kad_out_kmer(&out, kmer_int);
+        kad_out_char(&out, '\t');
+        print_mismatches(&out, probe_int, kmer_int);
+        kad_out_char(&out, '\t');
+      }
+
+      if(approx)
+        kad_out_str(&out, value.data(), value.size());
+      else
+        kad_out_counts(&out, counts, nb_counts, scale, NULL);
+      kad_out_char(&out, '\n');
+    }
+  }
+  kad_out_close(&out);
+
+  return 0;
+}
+
+/* Statistics reported by kad profile */
+enum KAD_PROFILE_STAT {
+  KAD_PROFILE_MEAN = 1,
+  KAD_PROFILE_MEDIAN = 2,
+  KAD_PROFILE_FRACTION = 4,
+  KAD_PROFILE_MIN_WINDOW = 8,
+  KAD_PROFILE_COVERAGE = 16
+};
+
+const char* kad_profile_stat_names[] = { "mean", "median", "fraction", "min_window", "coverage" };
+
+int parse_profile_stats(char* str) {
+  int stats = 0;
+  for (char *name = strtok(str, ","); name; name = strtok(NULL, ",")) {
+    int i = 0;
+    while(i < 5 && strcmp(name, kad_profile_stat_names[i]) != 0) i++;
+    if(i == 5) {
+      cerr << "Unknown statistic: " << name << endl;
+      exit(1);
+    }
+    stats |= 1 << i;
+  }
+  return stats;
+}
+
+/* A hit of a sample at a (valid) k-mer position of a record */
+typedef struct {
+  uint32_t column;
+  uint32_t pos;
+  uint16_t n;
+} profile_hit_t;
+
+/* Reusable buffers of a profile thread */
+typedef struct {
+  vector<uint64_t> kmers;  // k-mer of each valid position
+  vector<uint64_t> keys;   // sorted distinct k-mers
+  kad_batch_t batch;
+  vector<profile_hit_t> hits;
+  vector<uint16_t> coverage;
+  vector<uint16_t> sorted;
+} profile_buffers_t;
+
+static inline int nt4(char c) {
+  switch (c) {
+    case 'A': case 'a': return 0;
+    case 'C': case 'c': return 1;
+    case 'G': case 'g': return 2;
+    case 'T': case 't': return 3;
+  }
+  return 4;
+}
+
+static inline void append_value(string& out, double value, const char* format) {
+  char buf[32];
+  int l = snprintf(buf, sizeof(buf), format, value);
+  out += '\t';
+  out.append(buf, l);
+}
+
+/* Profile one record: the statistics of every column are computed on the
+ * coverage vector of its valid k-mers (k-mers with a base other than ACGT
+ * are skipped) and appended to out, one line per statistic */
+void kad_profile_record(kad_db_t* db, const string& name, const string& seq,
+    const vector<int32_t>& columns, const vector<uint16_t>& column_ids, const vector<float>& scale,
+    int stats, size_t window, profile_buffers_t& buf, string& out) {
+  size_t nb_columns = column_ids.size();
+
+  // K-mers of the record, with a rolling 2-bit encoding
+  buf.kmers.clear();
+  uint64_t kmer = 0;
+  size_t l = 0;
+  for (size_t i = 0; i < seq.size(); i++) {
+    int c = nt4(seq[i]);
+    if(c > 3) { l = 0; continue; }
+    kmer = (kmer << 2) | c;
+    if(++l >= KMER_LENGTH)
+      buf.kmers.push_back(kmer);
+  }
+  size_t nb_kmers = buf.kmers.size();
+
+  // One sorted MultiGet for all the distinct k-mers of the record
+  buf.keys.assign(buf.kmers.begin(), buf.kmers.end());
+  sort(buf.keys.begin(), buf.keys.end());
+  buf.keys.erase(unique(buf.keys.begin(), buf.keys.end()), buf.keys.end());
+  kad_check(kad_multi_get(db, &buf.batch, buf.keys.size(), buf.keys.data()), 4);
+
+  // Hits of the selected samples, grouped by column in position order
+  buf.hits.clear();
+  for (size_t pos = 0; pos < nb_kmers; pos++) {
+    size_t k = lower_bound(buf.keys.begin(), buf.keys.end(), buf.kmers[pos]) - buf.keys.begin();
+    const count_t* counts = buf.batch.counts[k];
+    size_t nb_counts = buf.batch.nb_counts[k];
+    for (size_t i = 0; i < nb_counts; i++) {
+      if(columns[counts[i].id] >= 0)
+        buf.hits.push_back({ (uint32_t)columns[counts[i].id], (uint32_t)pos, counts[i].n });
+    }
+  }
+  stable_sort(buf.hits.begin(), buf.hits.end(),
+      [](const profile_hit_t& a, const profile_hit_t& b) { return a.column < b.column; });
+
+  // Statistics of every column, zero for the samples with no hit
+  size_t w = min(window, nb_kmers);
+  vector<double> values(4 * nb_columns, 0);
+  vector<size_t> first_hit(nb_columns + 1, buf.hits.size());
+  for (size_t h = buf.hits.size(); h-- > 0;)
+    first_hit[buf.hits[h].column] = h;
+  for (size_t j = nb_columns; j-- > 0;)
+    first_hit[j] = min(first_hit[j], first_hit[j + 1]);
+  buf.coverage.assign(nb_kmers, 0);
+  for (size_t j = 0; j < nb_columns; j++) {
+    size_t begin = first_hit[j], end = first_hit[j + 1];
+    if(begin == end)
+      continue;
+    double sum = 0;
+    for (size_t h = begin; h < end; h++) {
+      buf.coverage[buf.hits[h].pos] = buf.hits[h].n;
+      sum += buf.hits[h].n;
+    }
+    float s = scale.empty() ? 1 : scale[column_ids[j]];
+    values[4*j] = s * sum / nb_kmers;
+    if(stats & KAD_PROFILE_MEDIAN) {
+      buf.sorted.assign(buf.coverage.begin(), buf.coverage.end());
+      nth_element(buf.sorted.begin(), buf.sorted.begin() + nb_kmers / 2, buf.sorted.end());
+      double median = buf.sorted[nb_kmers / 2];
+      if(nb_kmers % 2 == 0) {
+        uint16_t below = *max_element(buf.sorted.begin(), buf.sorted.begin() + nb_kmers / 2);
+        median = (median + below) / 2;
+      }
+      values[4*j + 1] = s * median;
+    }
+    values[4*j + 2] = (double)(end - begin) / nb_kmers;
+    if(stats & KAD_PROFILE_MIN_WINDOW) {
+      double window_sum = 0;
+      for (size_t i = 0; i < w; i++)
+        window_sum += buf.coverage[i];
+      double min_sum = window_sum;
+      for (size_t i = w; i < nb_kmers; i++) {
+        window_sum += (double)buf.coverage[i] - buf.coverage[i - w];
+        min_sum = min(min_sum, window_sum);
+      }
+      values[4*j + 3] = s * min_sum / w;
+    }
+    if(stats & KAD_PROFILE_COVERAGE) {
+      out += name;
+      out += "\tcoverage\t";
+      out += sample_name_of(db, column_ids[j]);
+      for (size_t i = 0; i < nb_kmers; i++) {
+        out += i == 0 ? '\t' : ',';
+        out += to_string(buf.coverage[i]);
+      }
+      out += '\n';
+    }
+    for (size_t h = begin; h < end; h++)
+      buf.coverage[buf.hits[h].pos] = 0;
+  }
+
+  const char* formats[] = { "%.2f", "%.2f", "%.3f", "%.2f" };
+  for (int stat = 0; stat < 4; stat++) {
+    if(!(stats & (1 << stat)))
+      continue;
+    out += name;
+    out += '\t';
+    out += kad_profile_stat_names[stat];
+    for (size_t j = 0; j < nb_columns; j++)
+      append_value(out, values[4*j + stat], formats[stat]);
+    out += '\n';
+  }
+}
+
+int kad_profile(kad_db_t* db, int argc, char **argv) {
+
+  int c, help = 0, nb_threads = 1, normalize = KAD_NORMALIZE_NONE;
+  int stats = KAD_PROFILE_MEAN | KAD_PROFILE_MEDIAN | KAD_PROFILE_FRACTION | KAD_PROFILE_MIN_WINDOW;
+  size_t window = KAD_PROFILE_WINDOW;
+  char *samples_list = NULL;
+  static struct option long_options[] = {
+    { "samples",   required_argument, 0, 's' },
+    { "stats",     required_argument, 0, 'S' },
+    { "window",    required_argument, 0, 'w' },
+    { "threads",   required_argument, 0, 't' },
+    { "normalize", required_argument, 0, 'N' },
+    { "help",      no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hs:S:w:t:N:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 's': samples_list = optarg; break;
+      case 'S': stats = parse_profile_stats(optarg); break;
+      case 'w': window = max(atoi(optarg), 1); break;
+      case 't': nb_threads = max(atoi(optarg), 1); break;
+      case 'N': normalize = parse_normalize(optarg); break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || optind >= argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad profile [options] sequences.fa\n\n");
+    fprintf(stderr, "Options: -s, --samples LIST    comma-separated samples to report [all]\n");
+    fprintf(stderr, "         -S, --stats LIST      statistics to report, among mean, median, fraction,\n");
+    fprintf(stderr, "                               min_window and coverage [mean,median,fraction,min_window]\n");
+    fprintf(stderr, "         -w, --window INT      width in k-mers of the min_window statistic [%d]\n", KAD_PROFILE_WINDOW);
+    fprintf(stderr, "         -t, --threads INT     number of threads [1]\n");
+    fprintf(stderr, "         -N, --normalize STR   cpm: counts per million, none: raw counts [none]\n");
+    fprintf(stderr, "         -h, --help            print this help message\n\n");
+    fprintf(stderr, "For every sequence, one line per statistic is printed with one column per\n");
+    fprintf(stderr, "sample: the mean and median count of the k-mers of the sequence, the fraction\n");
+    fprintf(stderr, "of its k-mers present in the sample and the lowest mean count of a window of\n");
+    fprintf(stderr, "consecutive k-mers. coverage prints the count of every k-mer of the sequence,\n");
+    fprintf(stderr, "one line per sample where the sequence is found.\n");
+		return 1;
+  }
+
+  vector<float> scale;
+  load_sample_scale(db, normalize, scale);
+
+  // Column of each sample id, -1 for the samples not reported
+  kad_filter_t filter;
+  kad_filter_init(&filter);
+  if(samples_list)
+    kad_filter_set_samples(db, &filter, samples_list);
+  vector<int32_t> columns(UINT16_MAX + 1, -1);
+  vector<uint16_t> column_ids;
+  cout << "sequence\tstatistic";
+  for (uint32_t id = 0; id < kad_nb_samples(db); id++) {
+    if(!kad_filter_in_set(&filter, id))
+      continue;
+    columns[id] = column_ids.size();
+    column_ids.push_back(id);
+    cout << "\t" << sample_name_of(db, id);
+  }
+  cout << endl;
+
+  gzFile fp = strcmp(argv[optind], "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(argv[optind], "r");
+  if(!fp) { fprintf(stderr, "Failed to open %s\n", argv[optind]); exit(EXIT_FAILURE); }
+  kseq_t *seq = kseq_init(fp);
+
+  // The records are read in batches, and the records of a batch are shared
+  // between the threads. The outputs are printed in the order of the file
+  vector<string> names, seqs, outputs;
+  vector<profile_buffers_t> buffers(nb_threads);
+  size_t nb_records = 0;
+  int eof = 0;
+  while(!eof) {
+    names.clear();
+    seqs.clear();
+    while(names.size() < KAD_PROFILE_BATCH) {
+      if(kseq_read(seq) < 0) {
+        eof = 1;
+        break;
+      }
+      names.push_back(string(seq->name.s, seq->name.l));
+      seqs.push_back(string(seq->seq.s, seq->seq.l));
+    }
+    kad_follow(db);
+    outputs.assign(names.size(), string());
+
+    atomic<size_t> next_record(0);
+    auto worker = [&](int thread) {
+      for (size_t i = next_record++; i < names.size(); i = next_record++) {
+        kad_profile_record(db, names[i], seqs[i], columns, column_ids, scale, stats, window,
+            buffers[thread], outputs[i]);
+      }
+    };
+    vector<std::thread> threads;
+    for (int i = 1; i < nb_threads; i++)
+      threads.push_back(std::thread(worker, i));
+    worker(0);
+    for (size_t i = 0; i < threads.size(); i++)
+      threads[i].join();
+
+    for (size_t i = 0; i < outputs.size(); i++)
+      cout.write(outputs[i].data(), outputs[i].size());
+    nb_records += names.size();
+  }
+
+  kseq_destroy(seq);
+  gzclose(fp);
+  cerr << "Profiled " << nb_records << " sequences" << endl;
+  return 0;
+}
+
+/* Id of the latest sample called name that has a sample-major layout */
+uint16_t kad_sample_major_id(kad_db_t* db, const char* name) {
+  vector<uint16_t> ids;
+  kad_sample_ids(db, name, ids);
+  if(ids.empty()) {
+    cerr << "Unknown sample: " << name << endl;
+    exit(1);
+  }
+  for (size_t i = ids.size(); db->sample_major && i-- > 0;) {
+    sample_stream_t stream;
+    sample_stream_open(db, ids[i], &stream);
+    int found = stream.it->Valid();
+    sample_stream_close(&stream);
+    if(found)
+      return ids[i];
+  }
+  cerr << "Sample " << name << " was not indexed with --sample-major" << endl;
+  exit(1);
+}
+
+enum KAD_EXTRACT_OP { KAD_EXTRACT_UNION, KAD_EXTRACT_INTERSECT, KAD_EXTRACT_DIFF };
+
+int kad_extract(kad_db_t* db, int argc, char **argv)
+{
+  int c, help = 0, op = KAD_EXTRACT_UNION, format = KAD_OUT_TSV, compress = 0;
+  static struct option long_options[] = {
+    { "op",     required_argument, 0, 'o' },
+    { "format", required_argument, 0, 'F' },
+    { "zstd",   no_argument,       0, 'z' },
+    { "help",   no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hzo:F:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'F': format = parse_output_format(optarg); break;
+      case 'z': compress = 1; break;
+      case 'o':
+        if(strcmp(optarg, "union") == 0) op = KAD_EXTRACT_UNION;
+        else if(strcmp(optarg, "intersect") == 0) op = KAD_EXTRACT_INTERSECT;
+        else if(strcmp(optarg, "diff") == 0) op = KAD_EXTRACT_DIFF;
+        else help = 1;
+        break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || optind >= argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad extract [options] sample [sample ...]\n\n");
+    fprintf(stderr, "Options: -o, --op STR  union: k-mers of any of the samples, intersect: k-mers\n");
+    fprintf(stderr, "                       of all the samples, diff: k-mers of the first sample\n");
+    fprintf(stderr, "                       that are in none of the others [union]\n");
+    fprintf(stderr, "         -F, --format  tsv: output lines, binary: records of the k-mers and their\n");
+    fprintf(stderr, "                       counts (see README) [tsv]\n");
+    fprintf(stderr, "         -z, --zstd    compress the output with zstd\n");
+    fprintf(stderr, "         -h, --help    print this help message\n\n");
+    fprintf(stderr, "Print the k-mers with their count in each sample (0 when absent). The samples\n");
+    fprintf(stderr, "must have been indexed with kad index --sample-major.\n");
+		return 1;
+  }
+
+  // Merge join of the sorted k-mer streams of the samples
+  size_t nb_streams = argc - optind;
+  vector<sample_stream_t> streams(nb_streams);
+  vector<int> alive(nb_streams);
+  vector<uint16_t> ids(nb_streams);
+  for (size_t i = 0; i < nb_streams; i++) {
+    ids[i] = kad_sample_major_id(db, argv[optind + i]);
+    sample_stream_open(db, ids[i], &streams[i]);
+    alive[i] = kad_check(sample_stream_next(&streams[i]), 4);
+  }
+
+  vector<count_t> counts(nb_streams);
+  vector<count_t> found;
+  kad_out_t out;
+  kad_out_init(&out, db, format, compress);
+  for (;;) {
+    int nb_alive = 0;
+    uint64_t kmer = UINT64_MAX;
+    for (size_t i = 0; i < nb_streams; i++) {
+      if(alive[i]) {
+        kmer = min(kmer, streams[i].kmer);
+        nb_alive++;
+      }
+    }
+    if(nb_alive == 0 || (op == KAD_EXTRACT_INTERSECT && nb_alive < (int)nb_streams)
+        || (op == KAD_EXTRACT_DIFF && !alive[0]))
+      break;
+
+    int support = 0;
+    found.clear();
+    for (size_t i = 0; i < nb_streams; i++) {
+      counts[i] = { ids[i], 0 };
+      if(alive[i] && streams[i].kmer == kmer) {
+        counts[i].n = streams[i].count;
+        found.push_back(counts[i]);
+        support++;
+        alive[i] = kad_check(sample_stream_next(&streams[i]), 4);
+      }
+    }
+    if((op == KAD_EXTRACT_INTERSECT && support < (int)nb_streams)
+        || (op == KAD_EXTRACT_DIFF && (counts[0].n == 0 || support > 1)))
+      continue;
+
+    if(format == KAD_OUT_BINARY) {
+      kad_out_record(&out, kmer, found.data(), found.size(), NULL);
+      continue;
+    }
+    kad_out_kmer(&out, kmer);
+    for (size_t i = 0; i < nb_streams; i++) {
+      kad_out_char(&out, '\t');
+      kad_out_uint(&out, counts[i].n);
+    }
+    kad_out_char(&out, '\n');
+  }
+  kad_out_close(&out);
+
+  for (size_t i = 0; i < nb_streams; i++)
+    sample_stream_close(&streams[i]);
+  return 0;
+}
+
+/* Set expressions of kad set. An operand is a sample name, or all:FILE and
+ * any:FILE for the samples listed in FILE (one per line): the k-mers of all
+ * of them or of any of them. The operators are & (intersection), |
+ * (union), - (difference) and ^ (symmetric difference), & binds tighter
+ * than the others, which are evaluated from left to right. Every operand
+ * is a slot of a presence bitset (a sample of all:FILE is a slot on its
+ * own), and the expression is compiled in postfix order, then in a truth
+ * table indexed by the bitset when it has few slots */
+enum KAD_SET_OP { KAD_SET_SLOT, KAD_SET_AND, KAD_SET_OR, KAD_SET_MINUS, KAD_SET_XOR };
+
+typedef struct {
+  int op;
+  int slot;
+} kad_set_instr_t;
+
+typedef struct {
+  const char* text;
+  const char* p;
+  vector<kad_set_instr_t> program;
+  vector<uint64_t> slots;   // slot mask of every sample id
+  vector<uint16_t> ids;     // sample ids of the expression
+  int nb_slots;
+  vector<uint8_t> table;    // value of every bitset, with at most KAD_SET_TABLE_SLOTS slots
+} kad_set_expr_t;
+
+static void kad_set_error(const kad_set_expr_t* e, const char* message) {
+  fprintf(stderr, "%s at position %d of the expression: %s\n", message, (int)(e->p - e->text), e->text);
+  exit(1);
+}
+
+static inline void kad_set_skip_spaces(kad_set_expr_t* e) {
+  while(isspace(*e->p)) e->p++;
+}
+
+/* A new slot for the sample ids called name */
+static void kad_set_add_slot(kad_db_t* db, kad_set_expr_t* e, const string& name) {
+  vector<uint16_t> ids;
+  if(kad_sample_ids(db, name.c_str(), ids) == 0) {
+    cerr << "Unknown sample: " << name << endl;
+    exit(1);
+  }
+  if(e->nb_slots == 64)
+    kad_set_error(e, "More than 64 samples");
+  for (size_t i = 0; i < ids.size(); i++) {
+    e->slots[ids[i]] |= 1ULL << e->nb_slots;
+    e->ids.push_back(ids[i]);
+  }
+  e->program.push_back({ KAD_SET_SLOT, e->nb_slots++ });
+}
+
+static void kad_set_parse_union(kad_db_t* db, kad_set_expr_t* e);
+
+static void kad_set_parse_operand(kad_db_t* db, kad_set_expr_t* e) {
+  kad_set_skip_spaces(e);
+  if(*e->p == '(') {
+    e->p++;
+    kad_set_parse_union(db, e);
+    kad_set_skip_spaces(e);
+    if(*e->p != ')')
+      kad_set_error(e, "Missing )");
+    e->p++;
+    return;
+  }
+  // A '-' inside a name is part of it, the operator must follow a space
+  const char* start = e->p;
+  while(*e->p && !isspace(*e->p) && !strchr("&|^()", *e->p))
+    e->p++;
+  if(e->p == start || *start == '-')
+    kad_set_error(e, "Expected a sample");
+  string name(start, e->p - start);
+  if(name.compare(0, 4, "all:") != 0 && name.compare(0, 4, "any:") != 0) {
+    kad_set_add_slot(db, e, name);
+    return;
+  }
+
+  gzFile fp = gzopen(name.c_str() + 4, "r");
+  if(!fp) { fprintf(stderr, "Failed to open %s\n", name.c_str() + 4); exit(EXIT_FAILURE); }
+  kstream_t *ks = ks_init(fp);
+  kstring_t *str = (kstring_t*)calloc(1, sizeof(kstring_t));
+  int dret, nb_samples = 0;
+  int any = name[1] == 'n';
+  while (ks_getuntil(ks, KS_SEP_LINE, str, &dret) >= 0) {
+    if(str->l == 0) continue;
+    if(any && nb_samples > 0) {
+      // The samples of any:FILE share the slot of the first one
+      vector<uint16_t> ids;
+      if(kad_sample_ids(db, str->s, ids) == 0) {
+        cerr << "Unknown sample: " << str->s << endl;
+        exit(1);
+      }
+      for (size_t i = 0; i < ids.size(); i++) {
+        e->slots[ids[i]] |= 1ULL << (e->nb_slots - 1);
+        e->ids.push_back(ids[i]);
+      }
+    } else {
+      kad_set_add_slot(db, e, str->s);
+      if(nb_samples > 0)
+        e->program.push_back({ KAD_SET_AND, 0 });
+    }
+    nb_samples++;
+  }
+  ks_destroy(ks);
+  gzclose(fp);
+  free(str->s); free(str);
+  if(nb_samples == 0)
+    kad_set_error(e, "Empty sample list");
+}
+
+static void kad_set_parse_intersect(kad_db_t* db, kad_set_expr_t* e) {
+  kad_set_parse_operand(db, e);
+  for (kad_set_skip_spaces(e); *e->p == '&'; kad_set_skip_spaces(e)) {
+    e->p++;
+    kad_set_parse_operand(db, e);
+    e->program.push_back({ KAD_SET_AND, 0 });
+  }
+}
+
+static void kad_set_parse_union(kad_db_t* db, kad_set_expr_t* e) {
+  kad_set_parse_intersect(db, e);
+  for (kad_set_skip_spaces(e); *e->p == '|' || *e->p == '-' || *e->p == '^'; kad_set_skip_spaces(e)) {
+    int op = *e->p == '|' ? KAD_SET_OR : *e->p == '-' ? KAD_SET_MINUS : KAD_SET_XOR;
+    e->p++;
+    kad_set_parse_intersect(db, e);
+    e->program.push_back({ op, 0 });
+  }
+}
+
+/* Evaluate the program on a presence bitset, the stack is a bitset too:
+ * its depth is at most the number of slots */
+static inline int kad_set_run(const kad_set_expr_t* e, uint64_t present) {
+  uint64_t stack = 0;
+  for (size_t i = 0; i < e->program.size(); i++) {
+    const kad_set_instr_t& instr = e->program[i];
+    if(instr.op == KAD_SET_SLOT) {
+      stack = (stack << 1) | ((present >> instr.slot) & 1);
+      continue;
+    }
+    uint64_t b = stack & 1, a = (stack >> 1) & 1, r;
+    switch(instr.op) {
+      case KAD_SET_AND: r = a & b; break;
+      case KAD_SET_OR: r = a | b; break;
+      case KAD_SET_MINUS: r = a & !b; break;
+      default: r = a ^ b; break;
+    }
+    stack = ((stack >> 2) << 1) | r;
+  }
+  return stack & 1;
+}
+
+static inline int kad_set_eval(const kad_set_expr_t* e, uint64_t present) {
+  return e->table.empty() ? kad_set_run(e, present) : e->table[present];
+}
+
+void kad_set_compile(kad_db_t* db, const char* text, kad_set_expr_t* e) {
+  e->text = e->p = text;
+  e->slots.assign(UINT16_MAX + 1, 0);
+  e->nb_slots = 0;
+  kad_set_parse_union(db, e);
+  kad_set_skip_spaces(e);
+  if(*e->p)
+    kad_set_error(e, "Unexpected character");
+  sort(e->ids.begin(), e->ids.end());
+  e->ids.erase(unique(e->ids.begin(), e->ids.end()), e->ids.end());
+  if(e->nb_slots <= KAD_SET_TABLE_SLOTS) {
+    e->table.resize(1ULL << e->nb_slots);
+    for (uint64_t present = 0; present < e->table.size(); present++)
+      e->table[present] = kad_set_run(e, present);
+  }
+}
+
+/* Options of kad set, also parsed by main to open the database for writing
+ * with --output */
+#define KAD_SET_SHORT_OPTIONS "hke:c:o:st:F:z"
+static struct option kad_set_options[] = {
+  { "expr",      required_argument, 0, 'e' },
+  { "min-count", required_argument, 0, 'c' },
+  { "output",    required_argument, 0, 'o' },
+  { "scan",      no_argument,       0, 's' },
+  { "threads",   required_argument, 0, 't' },
+  { "format",    required_argument, 0, 'F' },
+  { "zstd",      no_argument,       0, 'z' },
+  { "help",      no_argument,       0, 'h' },
+  { 0, 0, 0, 0 }
+};
+
+int kad_set(kad_db_t* db, int argc, char **argv)
+{
+  int c, help = 0, nb_threads = 1, show_counts = 1, scan = 0;
+  int format = KAD_OUT_TSV, compress = 0;
+  uint16_t min_count = 1;
+  const char *text = NULL, *output = NULL;
+  while ((c = getopt_long(argc, argv, KAD_SET_SHORT_OPTIONS, kad_set_options, NULL)) >= 0) {
+    switch (c) {
+      case 'e': text = optarg; break;
+      case 'c': min_count = min(atoi(optarg), UINT16_MAX); break;
+      case 'o': output = optarg; break;
+      case 's': scan = 1; break;
+      case 'k': show_counts = 0; break;
+      case 't': nb_threads = max(atoi(optarg), 1); break;
+      case 'F': format = parse_output_format(optarg); break;
+      case 'z': compress = 1; break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || !text) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad set [options] --expr EXPR\n\n");
+    fprintf(stderr, "Options: -e, --expr STR       set expression over samples, e.g. \"(A & B) - C\"\n");
+    fprintf(stderr, "         -c, --min-count INT  min count for a sample to have a k-mer [1]\n");
+    fprintf(stderr, "         -o, --output NAME    store the result as a new sample NAME instead of\n");
+    fprintf(stderr, "                              printing it, with the sum of the counts of the\n");
+    fprintf(stderr, "                              samples of the expression having the k-mer\n");
+    fprintf(stderr, "         -k                   only output the k-mers\n");
+    fprintf(stderr, "         -s, --scan           scan the whole database even if the samples were\n");
+    fprintf(stderr, "                              indexed with --sample-major\n");
+    fprintf(stderr, "         -t, --threads INT    number of threads of the scan [1]\n");
+    fprintf(stderr, "         -F, --format STR     tsv: output lines, binary: records of the k-mers and\n");
+    fprintf(stderr, "                              the counts of the samples of the expression (see\n");
+    fprintf(stderr, "                              README) [tsv]\n");
+    fprintf(stderr, "         -z, --zstd           compress the output with zstd\n");
+    fprintf(stderr, "         -h, --help           print this help message\n\n");
+    fprintf(stderr, "Operands: a sample name, all:FILE or any:FILE for the k-mers of all or any of\n");
+    fprintf(stderr, "the samples listed in FILE (one per line). Operators: & (intersection), |\n");
+    fprintf(stderr, "(union), - (difference), ^ (symmetric difference) and parentheses. & binds\n");
+    fprintf(stderr, "tighter than the others. Sample names may contain '-', so put spaces around\n");
+    fprintf(stderr, "the - operator.\n");
+		return 1;
+  }
+
+  if(format == KAD_OUT_BINARY && !show_counts) {
+    cerr << "The binary records hold the counts, -k cannot be used with them" << endl;
+    return 1;
+  }
+
+  kad_set_expr_t e;
+  kad_set_compile(db, text, &e);
+  // The counts printed are those of the samples of the expression
+  kad_filter_t in_expr;
+  kad_filter_init(&in_expr);
+  in_expr.in_set.assign((UINT16_MAX + 1) / 64, 0);
+  for (size_t i = 0; i < e.ids.size(); i++)
+    in_expr.in_set[e.ids[i] >> 6] |= 1ULL << (e.ids[i] & 63);
+
+  // Without --scan the k-mers of the samples are merged from the
+  // sample-major layout, when every sample of the expression has it: the
+  // operators give no k-mer outside of the samples
+  vector<sample_stream_t> streams;
+  if(!db->sample_major)
+    scan = 1;
+  for (size_t i = 0; !scan && i < e.ids.size(); i++) {
+    streams.resize(i + 1);
+    sample_stream_open(db, e.ids[i], &streams[i]);
+    if(!streams[i].it->Valid()) {
+      for (size_t j = 0; j <= i; j++)
+        sample_stream_close(&streams[j]);
+      streams.clear();
+      scan = 1;
+    }
+  }
+
+  // The k-mers of the new sample are kept per thread and added at the end,
+  // the scan does not write in the database
+  vector< vector< pair<uint64_t, uint32_t> > > results(output ? nb_threads : 0);
+  size_t nb_kmers = 0;
+  kad_out_t out;
+  if(!output)
+    kad_out_init(&out, db, format, compress);
+  auto select = [&](int thread, uint64_t kmer, const count_t* counts, size_t nb_counts, kad_out_t* out) {
+    uint64_t present = 0;
+    uint32_t total = 0;
+    for (size_t i = 0; i < nb_counts; i++) {
+      if(counts[i].n >= min_count && e.slots[counts[i].id]) {
+        present |= e.slots[counts[i].id];
+        total += counts[i].n;
+      }
+    }
+    if(!kad_set_eval(&e, present))
+      return;
+    if(output) {
+      results[thread].push_back(make_pair(kmer, total));
+      return;
+    }
+    if(out->format == KAD_OUT_BINARY) {
+      kad_out_record(out, kmer, counts, nb_counts, &in_expr);
+      return;
+    }
+    kad_out_kmer(out, kmer);
+    for (size_t i = 0; show_counts && i < nb_counts; i++) {
+      if(e.slots[counts[i].id]) {
+        const string& name = out->names[counts[i].id];
+        kad_out_char(out, '\t');
+        kad_out_str(out, name.data(), name.size());
+        kad_out_char(out, '|');
+        kad_out_uint(out, counts[i].n);
+      }
+    }
+    kad_out_char(out, '\n');
+  };
+
+  if(scan) {
+    kad_parallel_scan(db, nb_threads, output ? NULL : &out, select);
+    for (size_t i = 0; i < results.size(); i++)
+      nb_kmers += results[i].size();
+  } else {
+    // Merge of the sorted k-mers of the samples, in sample id order
+    vector<int> alive(streams.size());
+    for (size_t i = 0; i < streams.size(); i++)
+      alive[i] = kad_check(sample_stream_next(&streams[i]), 4);
+    vector<count_t> counts;
+    results.resize(output ? 1 : 0);
+    for (;;) {
+      uint64_t kmer = UINT64_MAX;
+      int nb_alive = 0;
+      for (size_t i = 0; i < streams.size(); i++) {
+        if(alive[i]) {
+          kmer = min(kmer, streams[i].kmer);
+          nb_alive++;
+        }
+      }
+      if(nb_alive == 0)
+        break;
+      counts.clear();
+      for (size_t i = 0; i < streams.size(); i++) {
+        if(alive[i] && streams[i].kmer == kmer) {
+          counts.push_back({ e.ids[i], (uint16_t)streams[i].count });
+          alive[i] = kad_check(sample_stream_next(&streams[i]), 4);
+        }
+      }
+      select(0, kmer, counts.data(), counts.size(), &out);
+    }
+    for (size_t i = 0; i < streams.size(); i++)
+      sample_stream_close(&streams[i]);
+    nb_kmers = output ? results[0].size() : 0;
+  }
+  if(!output)
+    kad_out_close(&out);
+
+  if(output) {
+    kad_ingest_t* session;
+    kad_check(kad_ingest_begin(db, output, 0, &session), 3);
+    for (size_t t = 0; t < results.size(); t++) {
+      for (size_t i = 0; i < results[t].size(); i++)
+        kad_check(kad_ingest_add(session, results[t][i].first, results[t][i].second), 4);
+      vector< pair<uint64_t, uint32_t> >().swap(results[t]);
+    }
+    kad_check(kad_ingest_commit(session), 4);
+    fprintf(stderr, "Stored %zu kmers in the sample %s\n", nb_kmers, output);
+  }
+  return 0;
+}
+
+/* Open a file of counts, gzipped or not, or stdin for '-'. The files are
+ * only read forward, so they can also be pipes or FIFOs */
+gzFile kad_open_input(const char* file) {
+  gzFile fp = strcmp(file, "-") == 0 ? gzdopen(fileno(stdin), "r") : gzopen(file, "r");
+  if(!fp) { fprintf(stderr, "Failed to open %s\n", file); exit(EXIT_FAILURE); }
+  gzbuffer(fp, KAD_INPUT_BUFFER);
+  return fp;
+}
+
+/* Progress of the index commands, printed on stderr every
+ * KAD_PROGRESS_SECONDS as a line of fields for scripts:
+ *   progress kmers=N bytes=B rate=R [percent=P eta=S]
+ * bytes is the position in the uncompressed input and rate is in k-mers
+ * per second. The percentage and the ETA in seconds are only known for
+ * regular files, from the position in the compressed file */
+typedef struct {
+  gzFile fp;
+  int64_t size; // 0 for pipes
+  double t_start, t_next;
+} kad_meter_t;
+
+void kad_meter_init(kad_meter_t* meter, gzFile fp, const char* file) {
+  struct stat st;
+  meter->fp = fp;
+  meter->size = strcmp(file, "-") != 0 && stat(file, &st) == 0 && S_ISREG(st.st_mode) ? st.st_size : 0;
+  meter->t_start = kad_realtime();
+  meter->t_next = meter->t_start + KAD_PROGRESS_SECONDS;
+}
+
+void kad_meter_update(kad_meter_t* meter, size_t nb_kmers) {
+  if(nb_kmers % 65536 != 0)
+    return;
+  double now = kad_realtime();
+  if(now < meter->t_next)
+    return;
+  meter->t_next = now + KAD_PROGRESS_SECONDS;
+  double elapsed = now - meter->t_start;
+  fprintf(stderr, "progress kmers=%zu bytes=%" PRId64 " rate=%.0f", nb_kmers, (int64_t)gztell(meter->fp),
+      nb_kmers / elapsed);
+  // Plain files are read ahead in the output buffer of zlib
+  z_off_t position = gzdirect(meter->fp) ? gztell(meter->fp) : gzoffset(meter->fp);
+  if(meter->size > 0 && position > 0) {
+    double done = min(1.0, (double)position / meter->size);
+    fprintf(stderr, " percent=%.1f eta=%.0f", 100 * done, elapsed * (1 - done) / done);
+  }
+  fprintf(stderr, "\n");
+}
+
+/* Replace the sketch of the database by a new one of bytes bytes, filled
+ * with a full scan. Returns the number of k-mers scanned */
+size_t kad_sketch_build(kad_db_t* db, size_t bytes) {
+  delete db->sketch;
+  db->sketch = kad_sketch_new(bytes);
+  size_t nb_kmers = 0;
+  kad_check(kad_scan(db, 0, UINT64_MAX, [&](uint64_t kmer, const count_t* counts, size_t nb_counts) {
+    for (size_t i = 0; i < nb_counts; i++)
+      kad_sketch_add(db->sketch, kmer, counts[i].n);
+    nb_kmers++;
+  }), 4);
+  return nb_kmers;
+}
+
+/* Give the database a sketch of bytes bytes before an index run (--sketch),
+ * so that the run keeps it up to date and saves it. The sketch of an empty
+ * database starts empty, the others are built with a scan as kad sketch
+ * does. A sketch that covers the database is kept as it is */
+void kad_index_sketch(kad_db_t* db, size_t bytes) {
+  if(db->sketch)
+    return;
+  if(kad_nb_samples(db) == 0) {
+    db->sketch = kad_sketch_new(bytes);
+    return;
+  }
+  double t_start = kad_realtime();
+  size_t nb_kmers = kad_sketch_build(db, bytes);
+  fprintf(stderr, "Sketched the %zu kmers of the database in %.2fs\n", nb_kmers, kad_realtime() - t_start);
+}
+
+int kad_index(kad_db_t* db, int argc, char **argv)
+{
+  int c, bulk = 0, help = 0, sample_major = 0, binary = 0, resume = 0, checkpoint = 0;
+  size_t sketch_bytes = 0;
+  static struct option long_options[] = {
+    { "bulk",         no_argument,       0, 'b' },
+    { "sample-major", no_argument,       0, 'S' },
+    { "binary",       no_argument,       0, 'B' },
+    { "resume",       no_argument,       0, 'r' },
+    { "checkpoint",   required_argument, 0, 'c' },
+    { "sketch",       required_argument, 0, 'k' },
+    { "help",         no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hbSBrc:k:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'b': bulk = 1; break;
+      case 'S': sample_major = 1; break;
+      case 'B': binary = 1; break;
+      case 'r': resume = 1; break;
+      case 'c': checkpoint = atoi(optarg); break;
+      case 'k': sketch_bytes = parse_size(optarg); break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || argc - optind < 2 || (resume && sample_major)) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad index [options] sample_name counts.tsv\n\n");
+    fprintf(stderr, "Options: -b, --bulk           bulk-load profile: no WAL, large memtables and a\n");
+    fprintf(stderr, "                              single compaction at the end\n");
+    fprintf(stderr, "         -S, --sample-major   also store the k-mers of the sample in sorted blocks,\n");
+    fprintf(stderr, "                              to extract it without a full scan (see kad extract).\n");
+    fprintf(stderr, "                              The indexing cannot be resumed\n");
+    fprintf(stderr, "         -B, --binary         read binary records instead of text lines: a k-mer in\n");
+    fprintf(stderr, "                              the 2-bit encoding of kad (uint64) and its count\n");
+    fprintf(stderr, "                              (uint32), both little-endian\n");
+    fprintf(stderr, "         -r, --resume         resume the interrupted indexing of sample_name from\n");
+    fprintf(stderr, "                              its last progress marker, with the same counts.tsv\n");
+    fprintf(stderr, "         -c, --checkpoint INT write batches between two progress markers\n");
+    fprintf(stderr, "                              [%d, %d with --bulk]\n", KAD_CHECKPOINT_BATCHES,
+        KAD_BULK_WRITE_BUFFER_SIZE / KAD_BATCH_BYTES);
+    fprintf(stderr, "         -k, --sketch SIZE    create the sketch of the database (see kad sketch) with\n");
+    fprintf(stderr, "                              SIZE bytes if it has none, and keep it up to date\n");
+    fprintf(stderr, "         -h, --help           print this help message\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "counts.tsv may be gzipped, and '-' reads the counts from stdin, so that kad\n");
+    fprintf(stderr, "can index the output of a k-mer counter while it runs. A resumed run skips\n");
+    fprintf(stderr, "the part of the input already indexed, a pipe must replay the same counts.\n");
+		return 1;
+  }
+  // With --bulk the counts are flushed at every marker, once per memtable
+  if(checkpoint <= 0)
+    checkpoint = bulk ? KAD_BULK_WRITE_BUFFER_SIZE / KAD_BATCH_BYTES : KAD_CHECKPOINT_BATCHES;
+
+  char *sample_name = argv[optind];
+  char *file = argv[optind + 1];
+
+  int flags = 0;
+  rocksdb::Options saved_options;
+  if(bulk) {
+    kad_bulk_begin(db, &saved_options);
+    flags |= KAD_INGEST_NO_WAL;
+  }
+  if(sample_major)
+    flags |= KAD_INGEST_SAMPLE_MAJOR;
+  if(sketch_bytes > 0)
+    kad_index_sketch(db, sketch_bytes);
+  kad_ingest_t* session;
+  kad_progress_t progress = { 0, 0, 0, 0 };
+  if(resume)
+    kad_check(kad_ingest_resume(db, sample_name, flags, &session, &progress), 3);
+  else
+    kad_check(kad_ingest_begin(db, sample_name, flags, &session), 3);
+  double t_start = kad_realtime();
+
+  gzFile fp;
+	kstream_t *ks;
+	kstring_t *str,*kmer;
+  int dret;
+  size_t nb_kmers = 0;
+  uint64_t offset = progress.offset; // position of the next record
+
+  kmer  = (kstring_t*)calloc(1, sizeof(kstring_t));
+  str   = (kstring_t*)calloc(1, sizeof(kstring_t));
+  fp = kad_open_input(file);
+  if(resume) {
+    char last_kmer[KMER_LENGTH + 1];
+    kad_kmer_to_str(progress.last_kmer, last_kmer);
+    fprintf(stderr, "Resuming %s at byte %" PRIu64 ", after %" PRIu64 " kmers (last: %s)\n", sample_name,
+        progress.offset, progress.nb_kmers, last_kmer);
+    if(gzseek(fp, progress.offset, SEEK_SET) != (z_off_t)progress.offset) {
+      fprintf(stderr, "Failed to seek to byte %" PRIu64 " of %s\n", progress.offset, file);
+      kad_ingest_abort(session);
+      exit(EXIT_FAILURE);
+    }
+  }
+  kad_meter_t meter;
+  kad_meter_init(&meter, fp, file);
+
+  ks = ks_init(fp);
+
+  if(binary) {
+    // Records are decoded from a buffer of whole records, the remainder of
+    // a read is kept for the next one
+    vector<char> buf(KAD_INPUT_BUFFER);
+    size_t len = 0;
+    int n;
+    while ((n = gzread(fp, buf.data() + len, buf.size() - len)) > 0) {
+      len += n;
+      size_t nb_records = len / KAD_RECORD_BYTES;
+      for (size_t i = 0; i < nb_records; i++) {
+        uint64_t kmer_int;
+        uint32_t count;
+        memcpy(&kmer_int, &buf[i * KAD_RECORD_BYTES], sizeof(kmer_int));
+        memcpy(&count, &buf[i * KAD_RECORD_BYTES + sizeof(kmer_int)], sizeof(count));
+        kad_check(kad_ingest_add(session, kmer_int, count), 4);
+        offset += KAD_RECORD_BYTES;
+        kad_check(kad_ingest_checkpoint(session, offset, checkpoint), 4);
+        kad_meter_update(&meter, ++nb_kmers);
+      }
+      len -= nb_records * KAD_RECORD_BYTES;
+      memmove(buf.data(), &buf[nb_records * KAD_RECORD_BYTES], len);
+    }
+    if(n < 0 || len > 0) {
+      fprintf(stderr, n < 0 ? "Failed to read %s\n" : "Truncated record at the end of %s\n", file);
+      kad_ingest_abort(session);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // Every token read moves the offset by its length and its delimiter
+  while (!binary && ks_getuntil(ks, 0, str, &dret) >= 0) {
+    offset += str->l + (dret != 0);
+    kputs(str->s,kmer);
+    if(dret != '\n') {
+      int l = ks_getuntil(ks, 0, str, &dret);
+      offset += str->l + (dret != 0);
+      if(l > 0 && isdigit(str->s[0]))
+        kad_check(kad_ingest_add(session, kad_str_to_kmer(kmer->s), atoi(str->s)), 4);
+    }
+    kmer->l = 0;
+    kad_check(kad_ingest_checkpoint(session, offset, checkpoint), 4);
+    kad_meter_update(&meter, ++nb_kmers);
+  }
+
+  kad_check(kad_ingest_commit(session), 4);
+
+  double t_load = kad_realtime() - t_start;
+  fprintf(stderr, "Successfully loaded %zu kmers in %.2fs (%.0f kmers/s)\n", nb_kmers, t_load, nb_kmers / t_load);
+
+  if(bulk)
+    kad_bulk_finish(db, saved_options);
+
+  ks_destroy(ks);
+  gzclose(fp);
+  free(str->s); free(str);
+  free(kmer->s); free(kmer);
+  return 0;
+}
+
+/* A run of rows from a count matrix: the counts of keys[i] are
+ * counts[offsets[i]] .. counts[offsets[i+1]-1] */
+typedef struct {
+  vector<uint64_t> keys;
+  vector<size_t> offsets;
+  vector<count_t> counts;
+} bulk_run_t;
+
+void bulk_run_clear(bulk_run_t& run) {
+  // clear() keeps the capacity, so the arena is reused by the next run
+  run.keys.clear();
+  run.counts.clear();
+  run.offsets.clear();
+  run.offsets.push_back(0);
+}
+
+size_t bulk_run_bytes(const bulk_run_t& run) {
+  return run.keys.size() * (sizeof(uint64_t) + sizeof(size_t)) + run.counts.size() * sizeof(count_t);
+}
+
+/* Sort a run, merge it with the counts already in the database and ingest
+ * it as a single SST file */
+void bulk_run_ingest(kad_db_t* db, bulk_run_t& run, size_t run_id, kad_stats_t* stats) {
+  if(run.keys.empty())
+    return;
+
+  vector<uint32_t> order(run.keys.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  if(db->layout == KAD_LAYOUT_MINIMIZER) {
+    const vector<uint64_t>& keys = run.keys;
+    vector<uint32_t> minimizers(keys.size());
+    for (size_t i = 0; i < keys.size(); i++)
+      minimizers[i] = kad_minimizer(keys[i]);
+    stable_sort(order.begin(), order.end(), [&keys, &minimizers](uint32_t a, uint32_t b) {
+      return minimizers[a] < minimizers[b] || (minimizers[a] == minimizers[b] && keys[a] < keys[b]);
+    });
+  } else if(!is_sorted(run.keys.begin(), run.keys.end())) {
+    const vector<uint64_t>& keys = run.keys;
+    stable_sort(order.begin(), order.end(),
+        [&keys](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+  }
+
+  string sst_path = db->counts_db->GetName() + "_bulk_" + to_string(getpid()) + "_" + to_string(run_id) + ".sst";
+  rocksdb::SstFileWriter writer(rocksdb::EnvOptions(), db->counts_db->GetOptions());
+  rocksdb::Status s = writer.Open(sst_path);
+  if(!s.ok()) {
+    cerr << s.ToString() << endl;
+    exit(4);
+  }
+
+  // The existing values are read with a forward sweep in key order
+  rocksdb::Iterator* it = db->counts_db->NewIterator(rocksdb::ReadOptions());
+  it->SeekToFirst();
+  vector<count_t> merged;
+
+  for (size_t i = 0; i < order.size(); ) {
+    uint64_t kmer_int = run.keys[order[i]];
+    char buf[KAD_KEY_MAX_BYTES];
+    rocksdb::Slice key = kad_key(db, kmer_int, buf);
+    merged.clear();
+
+    if(it->Valid() && kad_key_compare(db, it->key(), key) < 0)
+      it->Seek(key);
+    if(it->Valid() && kad_key_kmer(db, it->key()) == kmer_int) {
+      const count_t* counts = (const count_t*)it->value().data();
+      merged.insert(merged.end(), counts, counts + it->value().size() / sizeof(count_t));
+    }
+
+    // Rows sharing the same k-mer are concatenated
+    size_t old_support = merged.size();
+    for (; i < order.size() && run.keys[order[i]] == kmer_int; i++) {
+      merged.insert(merged.end(), run.counts.begin() + run.offsets[order[i]],
+          run.counts.begin() + run.offsets[order[i] + 1]);
+    }
+    kad_stats_move(stats, old_support, merged.size());
+    for (size_t j = old_support; j < merged.size(); j++) {
+      stats->count_hist[count_bucket(merged[j].n)]++;
+      if(db->sketch)
+        kad_sketch_add(db->sketch, kmer_int, merged[j].n);
+    }
+
+    s = writer.Put(key, rocksdb::Slice((char*)merged.data(), merged.size() * sizeof(count_t)));
+    if(!s.ok()) {
+      cerr << s.ToString() << endl;
+      exit(4);
+    }
+  }
+  delete it;
+
+  s = writer.Finish();
+  if(s.ok()) {
+    rocksdb::IngestExternalFileOptions ingest_options;
+    ingest_options.move_files = true;
+    s = db->counts_db->IngestExternalFile({ sst_path }, ingest_options);
+  }
+  if(!s.ok()) {
+    cerr << s.ToString() << endl;
+    exit(4);
+  }
+  remove(sst_path.c_str());
+}
+
+/* Parse an unsigned integer, saturated to UINT32_MAX */
+static inline const char* parse_count(const char* p, uint32_t* n) {
+  uint64_t v = 0;
+  while(*p >= '0' && *p <= '9') {
+    v = v * 10 + (*p - '0');
+    v = v > UINT32_MAX ? UINT32_MAX : v;
+    p++;
+  }
+  *n = v;
+  return p;
+}
+
+/* Remove the tabs, spaces and carriage returns at the end of a line */
+static inline void trim_line(kstring_t* str) {
+  while(str->l > 0 && (str->s[str->l - 1] == '\t' || str->s[str->l - 1] == ' ' || str->s[str->l - 1] == '\r'))
+    str->s[--str->l] = '\0';
+}
+
+/* Split a line on tabs and spaces. Like the rows of kad index_bulk, every
+ * delimiter ends a field, so consecutive delimiters give empty fields */
+vector<string> split_fields(const char* line) {
+  vector<string> fields;
+  const char *p = line;
+  while(1) {
+    const char *q = p;
+    while(*q && *q != '\t' && *q != ' ') q++;
+    fields.push_back(string(p, q - p));
+    if(!*q)
+      break;
+    p = q + 1;
+  }
+  return fields;
+}
+
+int kad_index_bulk(kad_db_t* db, int argc, char **argv)
 {
-  uint64_t strint = 0;
-  for (size_t i = 0; i < KMER_LENGTH; i++) {
-    uint8_t curr = 0;
-    switch (str[i]) {
-      case 'A': { curr = DNA_MAP::A; break; }
-      case 'T': { curr = DNA_MAP::T; break; }
-      case 'C': { curr = DNA_MAP::C; break; }
-      case 'G': { curr = DNA_MAP::G; break; }
+  int c, bulk = 0, help = 0;
+  char *samples_list = NULL;
+  size_t sketch_bytes = 0;
+  static struct option long_options[] = {
+    { "samples", required_argument, 0, 's' },
+    { "bulk",    no_argument,       0, 'b' },
+    { "sketch",  required_argument, 0, 'k' },
+    { "help",    no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hbs:k:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 's': samples_list = optarg; break;
+      case 'b': bulk = 1; break;
+      case 'k': sketch_bytes = parse_size(optarg); break;
+      case 'h': help = 1; break;
+    }
+  }
+
+  if (help || optind >= argc) {
+    fprintf(stderr, "\n");
+    fprintf(stderr, "Usage:   kad index_bulk [options] counts.tsv\n\n");
+    fprintf(stderr, "Options: -s, --samples LIST  only load the comma-separated samples of LIST\n");
+    fprintf(stderr, "         -b, --bulk          bulk-load profile: no auto-compaction while loading\n");
+    fprintf(stderr, "                             and a single compaction at the end\n");
+    fprintf(stderr, "         -k, --sketch SIZE   create the sketch of the database (see kad sketch) with\n");
+    fprintf(stderr, "                             SIZE bytes if it has none, and keep it up to date\n");
+    fprintf(stderr, "         -h, --help          print this help message\n\n");
+    fprintf(stderr, "The first line holds the sample names, the following lines a k-mer\n");
+    fprintf(stderr, "followed by its count in each sample. '-' reads the matrix from stdin.\n");
+    return 1;
+  }
+
+  char *file = argv[optind];
+
+  gzFile fp;
+  kstream_t *ks;
+  kstring_t *str;
+  int dret = 0;
+  size_t nb_kmers = 0, nb_skipped = 0, run_id = 0;
+
+  str = (kstring_t*)calloc(1, sizeof(kstring_t));
+  fp = kad_open_input(file);
+  kad_meter_t meter;
+  kad_meter_init(&meter, fp, file);
+  ks = ks_init(fp);
+
+  if(ks_getuntil(ks, KS_SEP_LINE, str, &dret) < 0) {
+    fprintf(stderr, "Empty matrix %s\n", file);
+    exit(EXIT_FAILURE);
+  }
+  trim_line(str);
+  vector<string> header = split_fields(str->s);
+
+  // The header may or may not have a title for the k-mer column, this is
+  // decided from the number of fields of the first row
+  bool has_row = ks_getuntil(ks, KS_SEP_LINE, str, &dret) >= 0;
+  if(has_row) {
+    trim_line(str);
+    size_t nb_fields = split_fields(str->s).size();
+    if(nb_fields == header.size()) {
+      header.erase(header.begin());
+    } else if(nb_fields != header.size() + 1) {
+      fprintf(stderr, "The first row of %s has %zu fields, the header has %zu sample names\n", file,
+          nb_fields, header.size());
+      exit(EXIT_FAILURE);
+    }
+  }
+  for (size_t col = 0; col < header.size(); col++) {
+    if(header[col].empty()) {
+      fprintf(stderr, "Empty sample name in column %zu of the header of %s\n", col + 1, file);
+      exit(EXIT_FAILURE);
     }
-    strint = strint << 2;
-    strint = strint | curr;
   }
-  return strint;
-}
-
-string int_to_str(uint64_t kmer)
-{
-  uint8_t base;
-  string str;
-  for (int i=KMER_LENGTH; i>0; i--) {
-    base = (kmer >> (i*2-2)) & 3ULL;
-    char chr;
-		switch(base) {
-			case DNA_MAP::A: { chr = 'A'; break; }
-			case DNA_MAP::T: { chr = 'T'; break; }
-			case DNA_MAP::C: { chr = 'C'; break; }
-			case DNA_MAP::G: { chr = 'G'; break; }
-		}
-    str.push_back(chr);
-  }
-  return str;
-}
-
-typedef struct {
-  uint16_t id;
-  uint16_t n;
-} count_t;
 
-typedef struct {
-  rocksdb::DB* samples_db;
-  rocksdb::DB* counts_db;
-} kad_db_t;
-
-class KmerKeyComparator : public rocksdb::Comparator {
-  public:
-    int Compare(const rocksdb::Slice& a, const rocksdb::Slice& b) const {
-      uint64_t *kmer_a = (uint64_t*)a.data();
-      uint64_t *kmer_b = (uint64_t*)b.data();
-      if(*kmer_a < *kmer_b) {
-        return -1;
-      } else if(*kmer_b < *kmer_a) {
-        return +1;
+  size_t ncols = header.size();
+  vector<uint32_t> keep(ncols, samples_list ? 0 : UINT32_MAX);
+  vector<uint16_t> col_ids(ncols, 0);
+
+  if(samples_list) {
+    vector<string> selected;
+    for (char *name = strtok(samples_list, ","); name; name = strtok(NULL, ","))
+      selected.push_back(name);
+    for (size_t j = 0; j < selected.size(); j++) {
+      size_t col = find(header.begin(), header.end(), selected[j]) - header.begin();
+      if(col == ncols) {
+        fprintf(stderr, "Sample %s is not in the header of %s\n", selected[j].c_str(), file);
+        exit(EXIT_FAILURE);
       }
-      return 0;
+      keep[col] = UINT32_MAX;
     }
-    const char* Name() const { return "KmerKeyComparator"; }
-    void FindShortestSeparator(std::string*, const rocksdb::Slice&) const { }
-    void FindShortSuccessor(std::string*) const { }
-};
+  }
 
+  if(sketch_bytes > 0)
+    kad_index_sketch(db, sketch_bytes);
+  int update_stats = -1;
+  for (size_t col = 0; col < ncols; col++) {
+    if(keep[col]) {
+      kad_check(add_sample(db, header[col].c_str(), &col_ids[col]), 3);
+      if(update_stats < 0)
+        update_stats = kad_has_stats(db, col_ids[col]);
+    }
+  }
+  kad_stats_t stats;
+  kad_stats_init(&stats);
+
+  rocksdb::Options saved_options;
+  if(bulk)
+    kad_bulk_begin(db, &saved_options);
+  double t_start = kad_realtime();
+
+  bulk_run_t run;
+  bulk_run_clear(run);
+  uint32_t chunk_counts[BULK_COLUMN_CHUNK];
+  vector<sample_totals_t> totals(ncols, { 0, 0 });
+  vector<sample_hist_t> hists(ncols);
+  memset(hists.data(), 0, ncols * sizeof(sample_hist_t));
+
+  for (; has_row; has_row = ks_getuntil(ks, KS_SEP_LINE, str, &dret) >= 0) {
+    trim_line(str);
+    const char *p = str->s;
+    const char *kmer_end = p;
+    while(*kmer_end && *kmer_end != '\t' && *kmer_end != ' ') kmer_end++;
+    if(!is_valid_kmer(p, kmer_end - p)) {
+      nb_skipped++;
+      continue;
+    }
+    uint64_t kmer_int = kad_str_to_kmer(str->s);
+    p = *kmer_end ? kmer_end + 1 : kmer_end;
+    // Each column has to start after a delimiter, and no delimiter may
+    // follow the last one
+    int more = *kmer_end != '\0', bad_row = 0;
+
+    // The row is decoded in the arena, one chunk of columns at a time. Every
+    // column is written and the write cursor only moves on non-zero counts,
+    // so the zero columns are dropped without branching
+    size_t row_start = run.counts.size();
+    run.counts.resize(row_start + ncols);
+    count_t *row = &run.counts[row_start];
+    size_t l = 0;
+    for (size_t col = 0; col < ncols; col += BULK_COLUMN_CHUNK) {
+      size_t chunk = min((size_t)BULK_COLUMN_CHUNK, ncols - col);
+      for (size_t j = 0; j < chunk; j++) {
+        bad_row |= !more;
+        p = parse_count(p, &chunk_counts[j]);
+        while(*p && *p != '\t' && *p != ' ') p++;
+        more = *p != '\0';
+        if(*p) p++;
+      }
+      // The totals add the raw counts, as kad_ingest_add() does
+      for (size_t j = 0; j < chunk; j++) {
+        uint32_t raw = chunk_counts[j] & keep[col + j];
+        uint16_t n = raw > UINT16_MAX ? UINT16_MAX : raw;
+        row[l] = { col_ids[col + j], n };
+        l += (n != 0);
+        totals[col + j].nb_kmers += (n != 0);
+        totals[col + j].total_count += raw;
+        hists[col + j].count_hist[count_bucket(n)] += (n != 0);
+      }
+    }
+    run.counts.resize(row_start + l);
+    if(bad_row || more) {
+      fprintf(stderr, "Row %zu of %s does not have the %zu counts of the header\n", nb_kmers + nb_skipped + 1, file,
+          ncols);
+      exit(EXIT_FAILURE);
+    }
 
+    if(l > 0) {
+      run.keys.push_back(kmer_int);
+      run.offsets.push_back(run.counts.size());
+    }
 
-kad_db_t* kad_open(const char* path) {
-  kad_db_t* kad_db = (kad_db_t*)malloc(sizeof(kad_db_t));
-  rocksdb::Options options_counts;
-  rocksdb::Options options_samples;
-  options_counts.create_if_missing = true;
-  options_samples.create_if_missing = true;
+    if(bulk_run_bytes(run) >= kad_ingest_bytes(db, BULK_RUN_BYTES)) {
+      bulk_run_ingest(db, run, run_id++, &stats);
+      bulk_run_clear(run);
+    }
 
-  // Set options for counts
-  KmerKeyComparator *cmp_kmers = new KmerKeyComparator(); // FIXME This should be deleted
-  options_counts.comparator = cmp_kmers;
-  options_counts.max_open_files = 1000;
+    kad_meter_update(&meter, ++nb_kmers);
+  }
 
-  string db_path = path;
-  db_path += "/";
-  db_path += KAD_DB_PREFIX;
+  bulk_run_ingest(db, run, run_id++, &stats);
 
-  if (stat(db_path.c_str(), &sb) != 0){
-    if (mkdir(db_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
-      cerr << "Failed to create KAD directory: " << db_path << endl;
-      exit(1);
-    } else {
-      cerr << "Successfully created KAD directory: " << db_path << endl;
-    }
+  for (size_t col = 0; col < ncols; col++) {
+    if(keep[col])
+      kad_check(put_sample_totals(db, col_ids[col], &totals[col], &hists[col]), 3);
   }
-  else if (!S_ISDIR(sb.st_mode)) {
-    exit(1);
-  }
-  
- rocksdb::Status status;
- 
- status = rocksdb::DB::Open(options_samples, string(db_path + "/samples").c_str(), &kad_db->samples_db);
- if(!status.ok()) {
-   cerr << "Failed to open samples database" << endl;
-   exit(2);
- }
+  if(update_stats)
+    kad_check(kad_save_stats(db, &stats), 3);
+  if(db->sketch)
+    kad_check(kad_sketch_save(db), 3);
+
+  if(nb_skipped > 0)
+    cerr << "Skipped " << nb_skipped << " rows with an invalid k-mer" << endl;
+
+  double t_load = kad_realtime() - t_start;
+  fprintf(stderr, "Successfully loaded %zu kmers in %.2fs (%.0f kmers/s)\n", nb_kmers, t_load, nb_kmers / t_load);
 
- status = rocksdb::DB::Open(options_counts, string(db_path + "/counts").c_str(), &kad_db->counts_db);
- if(!status.ok()) {
-   cerr << "Failed to open counts database" << endl;
-   exit(2);
- }
+  if(bulk)
+    kad_bulk_finish(db, saved_options);
 
-  return kad_db;
+  ks_destroy(ks);
+  gzclose(fp);
+  free(str->s); free(str);
+  return 0;
 }
 
-void kad_destroy(kad_db_t *db) {
-  delete db->samples_db;
-  delete db->counts_db;
-  free(db);
+std::atomic<bool> kad_interrupted(false);
+
+void kad_interrupt(int signum) {
+  kad_interrupted = true;
 }
 
-uint16_t add_sample(kad_db_t* db, const char* sample_name){
-  uint16_t nb_keys;
-  string value;
-  // FIXME Test that "sample_name" is different from _nb_keys
-  // FIXME This should be atomic
-  rocksdb::Status s = db->samples_db->Get(rocksdb::ReadOptions(), "_nb_keys", &value);
-  if(s.ok()) {
-    nb_keys = atoi(value.c_str());
-  } else {
-    nb_keys = 0;
+/* Size and read amplification (number of sorted runs a lookup can go
+ * through: every L0 file plus every non-empty level) of the counts database */
+void print_counts_layout(kad_db_t* db, const char* when) {
+  uint64_t sst_size = 0, live_size = 0, nb_files, read_amp = 0;
+  db->counts_db->GetIntProperty("rocksdb.total-sst-files-size", &sst_size);
+  db->counts_db->GetIntProperty("rocksdb.estimate-live-data-size", &live_size);
+  int num_levels = db->counts_db->GetOptions().num_levels;
+  for (int level = 0; level < num_levels; level++) {
+    if(db->counts_db->GetIntProperty("rocksdb.num-files-at-level" + to_string(level), &nb_files))
+      read_amp += level == 0 ? nb_files : (nb_files > 0);
+  }
+  fprintf(stderr, "%-7s SST files: %.1f MB, live data: %.1f MB, read amplification: %" PRIu64 "\n",
+      when, sst_size / 1048576.0, live_size / 1048576.0, read_amp);
+}
+
+int kad_optimize(kad_db_t* db, int argc, char **argv)
+{
+  int c, help = 0, nb_threads = 1;
+  kad_counts_config_t config = { 10, rocksdb::kZSTD, 16384, 3 };
+  static struct option long_options[] = {
+    { "bloom-bits",  required_argument, 0, 'b' },
+    { "compression", required_argument, 0, 'c' },
+    { "level",       required_argument, 0, 'l' },
+    { "dict-bytes",  required_argument, 0, 'D' },
+    { "threads",     required_argument, 0, 't' },
+    { "help",        no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hb:c:l:D:t:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'b': config.bloom_bits = atoi(optarg); break;
+      case 'c':
+        if(strcmp(optarg, "zstd") == 0) config.compression = rocksdb::kZSTD;
+        else if(strcmp(optarg, "lz4") == 0) config.compression = rocksdb::kLZ4Compression;
+        else if(strcmp(optarg, "snappy") == 0) config.compression = rocksdb::kSnappyCompression;
+        else if(strcmp(optarg, "none") == 0) config.compression = rocksdb::kNoCompression;
+        else { cerr << "Unknown compression: " << optarg << endl; return 1; }
+        break;
+      case 'l': config.level = atoi(optarg); break;
+      case 'D': config.dict_bytes = atoi(optarg); break;
+      case 't': nb_threads = max(atoi(optarg), 1); break;
+      case 'h': help = 1; break;
+    }
   }
-  rocksdb::Slice key((char*)&nb_keys, sizeof(uint16_t));
-  s = db->samples_db->Put(rocksdb::WriteOptions(), key, sample_name);
+
+  if (help) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad optimize [options]\n\n");
+    fprintf(stderr, "Compact the whole counts database into its last level, with a stronger\n");
+    fprintf(stderr, "compression and new bloom filters. It can be interrupted with Ctrl-C\n");
+    fprintf(stderr, "and resumed by running it again.\n\n");
+    fprintf(stderr, "Options: -b, --bloom-bits INT    bits per key of the bloom filters, 0 for none [10]\n");
+    fprintf(stderr, "         -c, --compression STR   zstd, lz4, snappy or none [zstd]\n");
+    fprintf(stderr, "         -l, --level INT         compression level [3]\n");
+    fprintf(stderr, "         -D, --dict-bytes INT    size of the zstd dictionary trained on the count\n");
+    fprintf(stderr, "                                 lists, 0 for none [16384]\n");
+    fprintf(stderr, "         -t, --threads INT       number of compaction threads [1]\n");
+    fprintf(stderr, "         -h, --help              print this help message\n");
+		return 1;
+  }
+
+  // The new settings are stored first, and the counts database is reopened
+  // with them so that the compaction writes the new filters and codec
+  rocksdb::Status s = db->samples_db->Put(rocksdb::WriteOptions(), "_counts_options",
+      rocksdb::Slice((char*)&config, sizeof(kad_counts_config_t)));
   if(!s.ok()) {
-    cerr << "failed to add sample to the database" << endl;
+    cerr << "failed to store the options of the counts database" << endl;
     exit(3);
-  } 
-  // Update the number of keys
-  std::string nb_keys_str = std::to_string(nb_keys+1);
-  s = db->samples_db->Put(rocksdb::WriteOptions(), "_nb_keys", nb_keys_str);
+  }
+  if(db->sample_major)
+    db->counts_db->DestroyColumnFamilyHandle(db->sample_major);
+  delete db->counts_db;
+  rocksdb::Options options_counts = kad_counts_options(&config, db->memory, db->layout);
+  options_counts.IncreaseParallelism(nb_threads);
+  s = kad_open_db(options_counts, string(db->path) + "/counts", NULL, "counts", KAD_READ_WRITE,
+      &db->counts_db, &db->sample_major);
   if(!s.ok()) {
-    cerr << "failed to update the number of keys in the samples database" << endl;
-    exit(3);
+    cerr << "Failed to open counts database: " << s.ToString() << endl;
+    exit(2);
   }
-  return nb_keys;
-}
 
-string get_sample(kad_db_t* db, uint16_t id) {
-  string value;
-  rocksdb::Slice key((char*)&id, sizeof(uint16_t));
-  rocksdb::Status s = db->samples_db->Get(rocksdb::ReadOptions(), key, &value);
-  return value;
-}
+  print_counts_layout(db, "Before:");
 
-void print_counts(kad_db_t* db, size_t nb_counts, count_t* counts) {
-  // FIXME add local hash for sample names
-  for(size_t i = 0; i < nb_counts; i++) {
-    string sample_name = get_sample(db, counts[i].id);
-    if(i > 0)
-      cout << "\t";
-    cout << sample_name << "|" << counts[i].n;
+  rocksdb::CompactRangeOptions compact_options;
+  compact_options.bottommost_level_compaction = rocksdb::BottommostLevelCompaction::kForceOptimized;
+  compact_options.max_subcompactions = nb_threads;
+  compact_options.canceled = &kad_interrupted;
+  signal(SIGINT, kad_interrupt);
+  signal(SIGTERM, kad_interrupt);
+
+  int done = kad_compact(db, compact_options, "_optimize_progress");
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+
+  print_counts_layout(db, "After:");
+  if(!done) {
+    cerr << "Run kad optimize again to resume" << endl;
+    return 1;
   }
+  return 0;
 }
 
-int kad_test(kad_db_t* db, int argc, char **argv) {
-  //char kmer[33] = "AGAGGAGGGACGGGCTGAAAAAGTACTCATTG";
-  return 0;
+/* The copies are taken from a read-only instance and do not stop a running
+ * indexer, the WAL files are copied instead of flushing the memtables. See
+ * kad_copy_db() for the order of the copies */
+rocksdb::Status kad_checkpoint_db(rocksdb::DB* db, const string& dest) {
+  rocksdb::Checkpoint* checkpoint;
+  rocksdb::Status s = rocksdb::Checkpoint::Create(db, &checkpoint);
+  if(s.ok())
+    s = checkpoint->CreateCheckpoint(dest, UINT64_MAX);
+  delete checkpoint;
+  return s;
 }
 
-int kad_info(kad_db_t* db, int argc, char **argv) {
-  //char kmer[33] = "AGAGGAGGGACGGGCTGAAAAAGTACTCATTG";
-  string nb_kmers;
-  db->counts_db->GetProperty("rocksdb.estimate-num-keys", &nb_kmers);
-  string nb_samples;
-  rocksdb::Status s = db->samples_db->Get(rocksdb::ReadOptions(), "_nb_keys", &nb_samples);
-  cerr << "Nb kmers:   " << nb_kmers << endl;
-  cerr << "Nb samples: " << nb_samples << endl;
-  return 0;
+/* A read-only instance only sees the files that the database had when it
+ * was opened, and a compaction of a running indexer may delete one of them
+ * before it is copied. Such a copy fails with an IO error and is retried
+ * from a new instance, opened by this function: previous is closed unless
+ * it is db */
+kad_db_t* kad_reopen_read_only(kad_db_t* db, kad_db_t* previous) {
+  if(previous != db)
+    kad_destroy(previous);
+  kad_db_t* fresh;
+  kad_check(kad_open(db->path, KAD_READ_ONLY, NULL, db->io_flags, db->memory ? db->memory->total : 0, &fresh), 4);
+  return fresh;
 }
 
-int kad_samples(kad_db_t* db, int argc, char **argv) {
-  rocksdb::Iterator* it = db->samples_db->NewIterator(rocksdb::ReadOptions());
-  for (it->SeekToFirst(); it->Valid(); it->Next()) {
-    if(it->key().ToString().compare("_nb_keys") != 0) {
-      uint16_t *sample_id = (uint16_t*)it->key().data();
-      cout << *sample_id << "\t" << it->value().ToString() << endl;
-    }
+/* Hard link the sketch file path as dest, or copy it when dest is on
+ * another filesystem. The sketch file is replaced by a rename when it is
+ * saved, so the link never sees a partial one. Nothing is done when there
+ * is no sketch */
+int kad_copy_sketch(const string& path, const string& dest) {
+  if(link(path.c_str(), dest.c_str()) == 0 || errno == ENOENT)
+    return 0;
+  FILE* in = fopen(path.c_str(), "rb");
+  if(!in)
+    return errno == ENOENT ? 0 : -1;
+  FILE* out = fopen(dest.c_str(), "wb");
+  int ok = out != NULL;
+  char buffer[1 << 16];
+  size_t n;
+  while (ok && (n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+    ok = fwrite(buffer, 1, n, out) == n;
+  ok = ok && !ferror(in);
+  fclose(in);
+  if(out)
+    ok = fclose(out) == 0 && ok;
+  return ok ? 0 : -1;
+}
+
+/* Copy the database with copy_db(src, "samples") then copy_db(src,
+ * "counts"), and its sketch as sketch_dest. The copies hold the samples
+ * lock (see kad_lock_samples()) and are taken from a read-only instance
+ * opened after it: no sample is added or completed during the copy, so a
+ * sample complete in the copy has all its counts in it, and the counts of
+ * a sample being indexed belong to a sample recorded as indexing, that
+ * kad index resumes. A copy of the counts that fails with an IO error is
+ * retried from a new instance (see kad_reopen_read_only()) */
+template <typename F>
+rocksdb::Status kad_copy_db(kad_db_t* db, const string& sketch_dest, F copy_db) {
+  int lock = kad_lock_samples(db);
+  kad_db_t* src = kad_reopen_read_only(db, db);
+  rocksdb::Status s = copy_db(src, "samples");
+  if(s.ok())
+    s = copy_db(src, "counts");
+  for (int i = 1; s.IsIOError() && i < KAD_COPY_RETRIES; i++) {
+    src = kad_reopen_read_only(db, src);
+    s = copy_db(src, "counts");
   }
-  return 0;
+  if(s.ok() && kad_copy_sketch(string(src->path) + "/" + KAD_SKETCH_FILE, sketch_dest) != 0)
+    s = rocksdb::Status::IOError("Failed to copy the sketch to " + sketch_dest);
+  kad_destroy(src);
+  kad_unlock_samples(lock);
+  return s;
 }
 
-int kad_dump(kad_db_t* db, int argc, char **argv)
+/* Build the sketch of the database with a full scan. It is kept up to date
+ * by the index commands afterwards */
+int kad_sketch(kad_db_t* db, int argc, char **argv)
 {
-  int c, show_counts = 1, help = 0, min_support = 0, max_support = INT_MAX;
-  while ((c = getopt(argc, argv, "hnm:M:")) >= 0) {
+  int c, help = 0;
+  size_t bytes = 64 << 20;
+  static struct option long_options[] = {
+    { "size", required_argument, 0, 's' },
+    { "help", no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hs:", long_options, NULL)) >= 0) {
     switch (c) {
-      case 'n': show_counts = 0; break;
+      case 's': bytes = parse_size(optarg); break;
       case 'h': help = 1; break;
-      case 'm': min_support = atoi(optarg); break;
-      case 'M': max_support = atoi(optarg); break;
     }
   }
 
   if (help) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage:   kad dump\n\n");
-    fprintf(stderr, "Options: -n      only output k-mers\n");
-    fprintf(stderr, "         -h      print this help message\n");
-    fprintf(stderr, "         -m INT  min number of supported samples\n");
-    fprintf(stderr, "         -M INT  max number of supported samples\n");
+		fprintf(stderr, "Usage:   kad sketch [options]\n\n");
+    fprintf(stderr, "Options: -s, --size SIZE  size of the sketch, kept in memory by every command [64M]\n");
+    fprintf(stderr, "         -h, --help       print this help message\n\n");
+    fprintf(stderr, "The sketch holds an upper bound of the count of every k-mer in any sample. The\n");
+    fprintf(stderr, "lookups skip the k-mers it reports as absent, and kad query --approx answers\n");
+    fprintf(stderr, "from it alone. Use about 2 bytes per distinct k-mer for few false positives.\n");
 		return 1;
   }
 
-  rocksdb::Iterator* it = db->counts_db->NewIterator(rocksdb::ReadOptions());
-  for (it->SeekToFirst(); it->Valid(); it->Next()) {
-    uint64_t *kmer_int_found;
-
-    int nb_counts = it->value().size() / sizeof(count_t);
+  double t_start = kad_realtime();
+  size_t nb_kmers = kad_sketch_build(db, bytes);
+  kad_check(kad_sketch_save(db), 3);
 
-    if(nb_counts >= min_support && nb_counts <= max_support) {
-      kmer_int_found = (uint64_t*)it->key().data();
-      cout << int_to_str(*kmer_int_found);
-
-      if(show_counts) {
-        count_t *counts = (count_t*)it->value().data();
-        size_t nb_counts = it->value().size() / sizeof(count_t);
-        cout << "\t";
-        print_counts(db, nb_counts, counts);
-      }
-
-      cout << endl;
-    }
-  }
+  size_t nb_empty = 0;
+  for (size_t i = 0; i < db->sketch->cells.size(); i++)
+    nb_empty += db->sketch->cells[i] == 0;
+  fprintf(stderr, "Sketched %zu kmers in %.2fs (%zu MB, %.1f%% of the counters used)\n", nb_kmers,
+      kad_realtime() - t_start, (db->sketch->cells.size() * sizeof(uint16_t)) >> 20,
+      100.0 * (db->sketch->cells.size() - nb_empty) / db->sketch->cells.size());
   return 0;
 }
 
-uint64_t rand_uint64(void) {
-  uint64_t r = 0;
-  for (int i=0; i<64; i += 30) {
-    r = r*(RAND_MAX + (uint64_t)1) + rand();
+/* Copy the database in a new one with another key layout. The counts are
+ * sorted in the new order by runs, ingested as SST files like index_bulk */
+int kad_convert(kad_db_t* db, int argc, char **argv)
+{
+  int c, help = 0, layout = KAD_LAYOUT_MINIMIZER;
+  static struct option long_options[] = {
+    { "layout", required_argument, 0, 'l' },
+    { "help",   no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hl:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'l':
+        if(strcmp(optarg, "minimizer") == 0) layout = KAD_LAYOUT_MINIMIZER;
+        else if(strcmp(optarg, "kmer") == 0) layout = KAD_LAYOUT_KMER;
+        else help = 1;
+        break;
+      case 'h': help = 1; break;
+    }
   }
-  return r;
-}
-
-int kad_random_query(kad_db_t* db, int argc, char **argv) {
 
-  if (argc < 2) {
+  if (help || optind >= argc) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage:   kad random_query [options] nb_queries\n\n");
+		fprintf(stderr, "Usage:   kad convert [options] DEST\n\n");
+    fprintf(stderr, "Options: -l, --layout STR  key layout of the new database DEST [minimizer]\n");
+    fprintf(stderr, "                           kmer: keys ordered by k-mer\n");
+    fprintf(stderr, "                           minimizer: keys prefixed with the minimizer of the\n");
+    fprintf(stderr, "                           k-mer, the k-mers of a sequence are stored together\n");
+    fprintf(stderr, "         -h, --help        print this help message\n");
 		return 1;
   }
 
-  size_t nb_queries = atoi(argv[1]);
-	
-  string value;
+  const char* dest = argv[optind];
+  kad_check(kad_create(dest, layout), 1);
+  kad_db_t* out;
+  kad_check(kad_open(dest, KAD_READ_WRITE, NULL, 0, db->memory ? db->memory->total : 0, &out), 2);
+  double t_start = kad_realtime();
 
-  for(size_t i = 0; i < nb_queries; i++) {
-    uint64_t random_kmer = rand_uint64();
-    rocksdb::Slice key((char*)&random_kmer, sizeof(uint64_t));
-    rocksdb::Status s = db->counts_db->Get(rocksdb::ReadOptions(), key, &value);
+  // Samples, totals, histograms and settings
+  rocksdb::WriteBatch batch;
+  rocksdb::Iterator* it = db->samples_db->NewIterator(rocksdb::ReadOptions());
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    if(it->key().ToString() != "_header" && it->key().ToString() != "_key_layout")
+      batch.Put(it->key(), it->value());
+  }
+  kad_check(kad_status(it->status()), 4);
+  delete it;
+  kad_check(kad_status(out->samples_db->Write(rocksdb::WriteOptions(), &batch)), 3);
+  batch.Clear();
+  // The samples of a source older than the header are upgraded here
+  kad_check(kad_load_samples(out), 3);
+
+  rocksdb::Options saved_options;
+  kad_bulk_begin(out, &saved_options);
+  bulk_run_t run;
+  bulk_run_clear(run);
+  kad_stats_t stats;
+  kad_stats_init(&stats);
+  size_t run_id = 0, nb_kmers = 0;
+  kad_check(kad_scan(db, 0, UINT64_MAX, [&](uint64_t kmer, const count_t* counts, size_t nb_counts) {
+    run.keys.push_back(kmer);
+    run.counts.insert(run.counts.end(), counts, counts + nb_counts);
+    run.offsets.push_back(run.counts.size());
+    if(bulk_run_bytes(run) >= kad_ingest_bytes(out, BULK_RUN_BYTES)) {
+      bulk_run_ingest(out, run, run_id++, &stats);
+      bulk_run_clear(run);
+    }
+    if(++nb_kmers % NB_KMERS_PRINT == 0)
+      cerr << nb_kmers << " kmers converted" << endl;
+  }), 4);
+  bulk_run_ingest(out, run, run_id++, &stats);
+
+  // The sample-major blocks and the sketch do not depend on the layout
+  if(db->sample_major) {
+    kad_check(kad_status(out->counts_db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(),
+        KAD_SAMPLE_MAJOR, &out->sample_major)), 4);
+    rocksdb::ReadOptions read_options;
+    read_options.fill_cache = false;
+    it = db->counts_db->NewIterator(read_options, db->sample_major);
+    for (it->SeekToFirst(); it->Valid(); it->Next()) {
+      batch.Put(out->sample_major, it->key(), it->value());
+      if(batch.GetDataSize() >= kad_ingest_bytes(out, KAD_BATCH_BYTES)) {
+        kad_check(kad_status(out->counts_db->Write(rocksdb::WriteOptions(), &batch)), 4);
+        batch.Clear();
+      }
+    }
+    kad_check(kad_status(it->status()), 4);
+    delete it;
+    kad_check(kad_status(out->counts_db->Write(rocksdb::WriteOptions(), &batch)), 4);
+  }
+  if(db->sketch) {
+    out->sketch = new kad_sketch_t(*db->sketch);
+    kad_check(kad_sketch_save(out), 3);
   }
 
+  kad_bulk_finish(out, saved_options);
+  fprintf(stderr, "Converted %zu kmers in %.2fs\n", nb_kmers, kad_realtime() - t_start);
+  print_counts_layout(db, "Before:");
+  print_counts_layout(out, "After:");
+  kad_destroy(out);
   return 0;
 }
 
-int kad_query(kad_db_t* db, int argc, char **argv) {
-
+int kad_checkpoint(kad_db_t* db, int argc, char **argv)
+{
   if (argc < 2) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage:   kad query [options] kmer\n\n");
+		fprintf(stderr, "Usage:   kad checkpoint DEST\n\n");
+    fprintf(stderr, "Create a copy of the database in the new directory DEST, that can be\n");
+    fprintf(stderr, "used with --db DEST. Files are hard linked when DEST is on the same\n");
+    fprintf(stderr, "filesystem as the database.\n");
 		return 1;
   }
 
-  std::string value;
-  char *kmer = argv[1];
+  string dest = argv[1];
+  if (mkdir(dest.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0) {
+    cerr << "Failed to create checkpoint directory: " << dest << endl;
+    exit(1);
+  }
 
-  uint64_t kmer_int = str_to_int(kmer);
+  rocksdb::Status s = kad_copy_db(db, dest + "/" + KAD_SKETCH_FILE, [&](kad_db_t* src, const char* name) {
+    rocksdb::DB* src_db = strcmp(name, "samples") == 0 ? src->samples_db : src->counts_db;
+    return kad_checkpoint_db(src_db, dest + "/" + name);
+  });
+  if(!s.ok()) {
+    cerr << "Failed to create the checkpoint: " << s.ToString() << endl;
+    exit(4);
+  }
+  cerr << "Successfully created checkpoint: " << dest << endl;
+  return 0;
+}
 
-  rocksdb::Slice key((char*)&kmer_int, sizeof(uint64_t));
+rocksdb::BackupEngine* kad_open_backup_engine(const string& backup_dir) {
+  rocksdb::BackupEngine* backup_engine;
+  rocksdb::Status s = rocksdb::BackupEngine::Open(rocksdb::BackupEngineOptions(backup_dir),
+      rocksdb::Env::Default(), &backup_engine);
+  if(!s.ok()) {
+    cerr << "Failed to open the backup directory " << backup_dir << ": " << s.ToString() << endl;
+    exit(4);
+  }
+  return backup_engine;
+}
 
-  rocksdb::Status s = db->counts_db->Get(rocksdb::ReadOptions(), key, &value);
-  if (s.ok()) {
-    cout << kmer << "\t";
+/* Backup ids of samples_db whose metadata (the backup tag) matches the
+ * backups of counts_db */
+rocksdb::BackupID kad_find_backup(rocksdb::BackupEngine* backup_engine, const string& tag) {
+  vector<rocksdb::BackupInfo> infos;
+  backup_engine->GetBackupInfo(&infos);
+  for (size_t i = 0; i < infos.size(); i++) {
+    if(infos[i].app_metadata == tag)
+      return infos[i].backup_id;
+  }
+  return 0;
+}
 
-    count_t *counts = (count_t*)value.data();
-    size_t nb_counts = value.size() / sizeof(count_t);
+int kad_backup(kad_db_t* db, int argc, char **argv)
+{
+  int c, help = 0, list = 0;
+  static struct option long_options[] = {
+    { "list", no_argument, 0, 'l' },
+    { "help", no_argument, 0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hl", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'l': list = 1; break;
+      case 'h': help = 1; break;
+    }
+  }
 
-    print_counts(db, nb_counts, counts);
+  if (help || optind >= argc) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad backup [options] BACKUP_DIR\n\n");
+    fprintf(stderr, "Add an incremental backup of the database to BACKUP_DIR, only the files\n");
+    fprintf(stderr, "that are not already in BACKUP_DIR are copied. Use kad restore to get it back.\n\n");
+    fprintf(stderr, "Options: -l, --list  list the backups of BACKUP_DIR\n");
+    fprintf(stderr, "         -h, --help  print this help message\n");
+		return 1;
+  }
 
-    cout << endl;
+  string backup_dir = argv[optind];
+  mkdir(backup_dir.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  rocksdb::BackupEngine* counts_backup = kad_open_backup_engine(backup_dir + "/counts");
+  rocksdb::BackupEngine* samples_backup = kad_open_backup_engine(backup_dir + "/samples");
+
+  if(list) {
+    vector<rocksdb::BackupInfo> infos;
+    counts_backup->GetBackupInfo(&infos);
+    for (size_t i = 0; i < infos.size(); i++) {
+      char date[32];
+      time_t timestamp = infos[i].timestamp;
+      strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&timestamp));
+      cout << infos[i].backup_id << "\t" << date << "\t" << infos[i].size << endl;
+    }
+  } else {
+    // Both backups are tagged with the same metadata to be restored together
+    // The sketch is kept next to them, in the file named after the tag
+    string tag = to_string(time(NULL)) + "." + to_string(getpid());
+    mkdir((backup_dir + "/sketch").c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    rocksdb::Status s = kad_copy_db(db, backup_dir + "/sketch/" + tag, [&](kad_db_t* src, const char* name) {
+      if(strcmp(name, "samples") == 0)
+        return samples_backup->CreateNewBackupWithMetadata(src->samples_db, tag);
+      return counts_backup->CreateNewBackupWithMetadata(src->counts_db, tag);
+    });
+    if(!s.ok()) {
+      cerr << "Failed to create the backup: " << s.ToString() << endl;
+      exit(4);
+    }
+    vector<rocksdb::BackupInfo> infos;
+    counts_backup->GetBackupInfo(&infos);
+    cerr << "Successfully created backup " << infos.back().backup_id << " in " << backup_dir << endl;
   }
 
+  delete counts_backup;
+  delete samples_backup;
   return 0;
 }
 
-int kad_index(kad_db_t* db, int argc, char **argv)
+/* Restore a backup in db_path. It is called before the database is opened */
+int kad_restore(const char* db_path, int argc, char **argv)
 {
+  int c, help = 0;
+  rocksdb::BackupID backup_id = 0;
+  static struct option long_options[] = {
+    { "backup-id", required_argument, 0, 'i' },
+    { "help",      no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hi:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'i': backup_id = atoi(optarg); break;
+      case 'h': help = 1; break;
+    }
+  }
 
-  if (argc < 2) {
+  if (help || optind >= argc) {
 		fprintf(stderr, "\n");
-		fprintf(stderr, "Usage:   kad index [options] sample_name counts.tsv\n\n");
+		fprintf(stderr, "Usage:   kad [--db PATH] restore [options] BACKUP_DIR\n\n");
+    fprintf(stderr, "Restore a backup made by kad backup as a new database in PATH.\n\n");
+    fprintf(stderr, "Options: -i, --backup-id INT  backup to restore (see kad backup --list) [latest]\n");
+    fprintf(stderr, "         -h, --help           print this help message\n");
 		return 1;
   }
 
-  std::string value;
-  char *sample_name = argv[1];
-  char *file = argv[2];
+  if (stat(db_path, &sb) == 0) {
+    cerr << "Cannot restore in an existing database: " << db_path << endl;
+    exit(1);
+  }
 
-  uint16_t sample_id = add_sample(db, sample_name);
+  string backup_dir = argv[optind];
+  rocksdb::BackupEngine* counts_backup = kad_open_backup_engine(backup_dir + "/counts");
+  rocksdb::BackupEngine* samples_backup = kad_open_backup_engine(backup_dir + "/samples");
 
-  gzFile fp;
-	kstream_t *ks;
-	kstring_t *str,*kmer;
-  int dret, count_int;
-  uint16_t count;
-  uint64_t kmer_int;
-  size_t nb_kmers = 0;
-  size_t batch_i = 0;
-  rocksdb::WriteBatch batch;
+  vector<rocksdb::BackupInfo> infos;
+  counts_backup->GetBackupInfo(&infos);
+  if(infos.empty()) {
+    cerr << "No backup in " << backup_dir << endl;
+    exit(1);
+  }
+  string tag;
+  for (size_t i = 0; i < infos.size(); i++) {
+    if(backup_id == 0 || infos[i].backup_id == backup_id) {
+      tag = infos[i].app_metadata;
+      if(backup_id != 0) break;
+    }
+  }
+  if(backup_id == 0)
+    backup_id = infos.back().backup_id;
+  rocksdb::BackupID samples_backup_id = tag.empty() ? 0 : kad_find_backup(samples_backup, tag);
+  if(samples_backup_id == 0) {
+    cerr << "Backup " << backup_id << " was not found in " << backup_dir << endl;
+    exit(1);
+  }
 
-  kmer  = (kstring_t*)calloc(1, sizeof(kstring_t));
-  str   = (kstring_t*)calloc(1, sizeof(kstring_t));
-  fp = gzopen(file, "r");
-  if(!fp) { fprintf(stderr, "Failed to open %s\n", file); exit(EXIT_FAILURE); }
+  mkdir(db_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+  string counts_path = string(db_path) + "/counts";
+  string samples_path = string(db_path) + "/samples";
+  rocksdb::Status s = counts_backup->RestoreDBFromBackup(backup_id, counts_path, counts_path);
+  if(s.ok())
+    s = samples_backup->RestoreDBFromBackup(samples_backup_id, samples_path, samples_path);
+  if(s.ok() && kad_copy_sketch(backup_dir + "/sketch/" + tag, string(db_path) + "/" + KAD_SKETCH_FILE) != 0)
+    s = rocksdb::Status::IOError("Failed to restore the sketch");
+  if(!s.ok()) {
+    cerr << "Failed to restore the backup: " << s.ToString() << endl;
+    exit(4);
+  }
+  cerr << "Successfully restored backup " << backup_id << " in " << db_path << endl;
 
-  ks = ks_init(fp);
+  delete counts_backup;
+  delete samples_backup;
+  return 0;
+}
 
-  while (ks_getuntil(ks, 0, str, &dret) >= 0) {
-    kputs(str->s,kmer);
-    if(dret != '\n') {
-      if(ks_getuntil(ks, 0, str, &dret) > 0 && isdigit(str->s[0])) {
-        count_int = atoi(str->s);
-        if(count_int > UINT16_MAX)
-          count = UINT16_MAX;
-        else
-          count = (uint16_t)count_int;
-        
-        kmer_int = str_to_int(kmer->s);
-
-        rocksdb::Slice key((char*)&kmer_int, sizeof(uint64_t));
-
-        count_t *counts;
-        size_t nb_counts = 1;
-
-        rocksdb::Status s = db->counts_db->Get(rocksdb::ReadOptions(), key, &value);
-
-        // The k-mer is already in the database
-        if(s.ok()) {
-          nb_counts = (value.size() / sizeof(count_t)) + 1;
-          counts = (count_t*)malloc(sizeof(count_t) * nb_counts);
-          memcpy(counts,value.data(),value.size());
-        } else {
-          counts = (count_t*)malloc(sizeof(count_t));
-        }
+/* Random number generator of kad gen, seeded per chunk so that the output
+ * does not depend on the number of threads */
+static inline uint64_t splitmix64(uint64_t* state) {
+  uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
 
-        counts[nb_counts-1] = { sample_id, count };
-        
-        rocksdb::Slice counts_value((char*)counts, nb_counts * sizeof(count_t));
+static inline double rand_unit(uint64_t* state) {
+  return ((splitmix64(state) >> 11) + 1) * (1.0 / 9007199254740992.0); // (0, 1]
+}
 
-        if(batch_i < BUFFER_SIZE) {
-          batch.Put(key, counts_value);
-          ++batch_i;
-        }
+/* Compress in as one gzip member. Members compressed separately can be
+ * concatenated, gzread and zcat read them as a single stream */
+void gz_member(const string& in, int level, string& out) {
+  z_stream zs;
+  memset(&zs, 0, sizeof(zs));
+  deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+  out.resize(deflateBound(&zs, in.size()));
+  zs.next_in = (Bytef*)in.data();
+  zs.avail_in = in.size();
+  zs.next_out = (Bytef*)&out[0];
+  zs.avail_out = out.size();
+  deflate(&zs, Z_FINISH);
+  out.resize(zs.total_out);
+  deflateEnd(&zs);
+}
 
-        if(batch_i == BUFFER_SIZE ) {
-          s = db->counts_db->Write(rocksdb::WriteOptions(), &batch);
-          if(!s.ok()) {
-            cerr << s.ToString() << endl;
-            exit(4);
-          }
-          batch.Clear();
-          batch_i = 0;
-        }
-        free(counts);
+typedef struct {
+  uint64_t nb_kmers;
+  int nb_samples;
+  double zipf;     // exponent of the abundance distribution
+  double sharing;  // probability that a sample has a k-mer
+  int sorted;
+  int matrix;
+  uint64_t seed;
+} kad_gen_config_t;
+
+/* Generate the k-mers [first, last) in one text buffer per output file */
+void kad_gen_chunk(const kad_gen_config_t* config, uint64_t first, uint64_t last, vector<string>& outputs) {
+  uint64_t stride = UINT64_MAX / config->nb_kmers;
+  int nb_samples = config->nb_samples;
+  vector<uint16_t> counts(nb_samples);
+  char buf[32];
+  uint64_t state = config->seed ^ (first * 0xD1B54A32D192ED03ULL);
+
+  for (uint64_t i = first; i < last; i++) {
+    // Distinct k-mers: one per stride in sorted order, or a bijection of i
+    uint64_t mix = i + config->seed * 0x9E3779B97F4A7C15ULL;
+    uint64_t kmer = config->sorted ? i * stride + splitmix64(&mix) % stride : splitmix64(&mix);
+    char kmer_str[KMER_LENGTH + 1];
+    kad_kmer_to_str(kmer, kmer_str);
+
+    // The abundance of the k-mer follows a discrete power law, and every
+    // sample has it with probability sharing (at least one sample has it)
+    double abundance = min(pow(rand_unit(&state), -1.0 / (config->zipf - 1)), (double)UINT16_MAX);
+    int support = 0;
+    for (int j = 0; j < nb_samples; j++) {
+      counts[j] = 0;
+      if(rand_unit(&state) <= config->sharing) {
+        counts[j] = max(1.0, min(floor(abundance * (0.5 + rand_unit(&state))), (double)UINT16_MAX));
+        support++;
+      }
+    }
+    if(support == 0)
+      counts[splitmix64(&state) % nb_samples] = max(1.0, floor(abundance));
+
+    if(config->matrix) {
+      string& out = outputs[0];
+      out += kmer_str;
+      for (int j = 0; j < nb_samples; j++) {
+        int l = snprintf(buf, sizeof(buf), "\t%d", counts[j]);
+        out.append(buf, l);
+      }
+      out += '\n';
+    } else {
+      for (int j = 0; j < nb_samples; j++) {
+        if(counts[j] == 0)
+          continue;
+        int l = snprintf(buf, sizeof(buf), "\t%d\n", counts[j]);
+        outputs[j] += kmer_str;
+        outputs[j].append(buf, l);
       }
     }
-    kmer->l = 0;
-    nb_kmers++;
-    if(nb_kmers % NB_KMERS_PRINT == 0)
-      cerr << nb_kmers  << " kmers loaded" << endl;
   }
-
-  cerr << "Successfully loaded " << nb_kmers << " kmers" << endl;
-
-  ks_destroy(ks);
-  gzclose(fp);
-  free(str->s); free(str);
-  free(kmer->s); free(kmer);
-  return 0;
 }
 
-int kad_index_bulk(kad_db_t* db, int argc, char **argv)
+/* kad gen does not open a database */
+int kad_gen(int argc, char **argv)
 {
-
-  if (argc < 2) {
-    fprintf(stderr, "\n");
-    fprintf(stderr, "Usage:   kad index_bulk [options] counts.tsv\n\n");
-    return 1;
+  int c, help = 0, nb_threads = 1, level = 1;
+  kad_gen_config_t config = { 1000000, 10, 1.5, 0.3, 0, 0, 42 };
+  static struct option long_options[] = {
+    { "samples",  required_argument, 0, 's' },
+    { "kmers",    required_argument, 0, 'k' },
+    { "zipf",     required_argument, 0, 'z' },
+    { "sharing",  required_argument, 0, 'p' },
+    { "sorted",   no_argument,       0, 'o' },
+    { "matrix",   no_argument,       0, 'm' },
+    { "seed",     required_argument, 0, 'S' },
+    { "level",    required_argument, 0, 'l' },
+    { "threads",  required_argument, 0, 't' },
+    { "help",     no_argument,       0, 'h' },
+    { 0, 0, 0, 0 }
+  };
+  while ((c = getopt_long(argc, argv, "hs:k:z:p:omS:l:t:", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 's': config.nb_samples = atoi(optarg); break;
+      case 'k': config.nb_kmers = strtoull(optarg, NULL, 10); break;
+      case 'z': config.zipf = atof(optarg); break;
+      case 'p': config.sharing = atof(optarg); break;
+      case 'o': config.sorted = 1; break;
+      case 'm': config.matrix = 1; break;
+      case 'S': config.seed = strtoull(optarg, NULL, 10); break;
+      case 'l': level = atoi(optarg); break;
+      case 't': nb_threads = max(atoi(optarg), 1); break;
+      case 'h': help = 1; break;
+    }
   }
 
-  std::string value;
-  char *file = argv[1];
-
-	
-  gzFile fp;
-  kstream_t *ks;
-  kstring_t *str,*kmer;
-  int dret, count_int;
-  uint16_t * count;
-  uint64_t kmer_int;
-  size_t nb_kmers = 0;
-  size_t batch_i = 0;
-  rocksdb::WriteBatch batch;
-
-  size_t nsamples = 0;
-  size_t capacity = 10;
-  uint16_t * sample_ids  = (uint16_t*)malloc(sizeof(uint16_t)*capacity);
-
-  kmer  = (kstring_t*)calloc(1, sizeof(kstring_t));
-  str   = (kstring_t*)calloc(1, sizeof(kstring_t));
-  fp = gzopen(file, "r");
-  if(!fp) { fprintf(stderr, "Failed to open %s\n", file); exit(EXIT_FAILURE); }
+  if (help || optind >= argc || config.nb_samples < 1 || config.nb_samples > UINT16_MAX
+      || config.nb_kmers < 1 || config.zipf <= 1 || config.sharing < 0 || config.sharing > 1) {
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Usage:   kad gen [options] output_prefix\n\n");
+    fprintf(stderr, "Options: -s, --samples INT   number of samples [10]\n");
+    fprintf(stderr, "         -k, --kmers INT     number of distinct k-mers [1000000]\n");
+    fprintf(stderr, "         -z, --zipf FLOAT    exponent (> 1) of the power law of the k-mer abundances [1.5]\n");
+    fprintf(stderr, "         -p, --sharing FLOAT probability that a sample has a k-mer [0.3]\n");
+    fprintf(stderr, "         -o, --sorted        write the k-mers in sorted order\n");
+    fprintf(stderr, "         -m, --matrix        write a single count matrix (for index_bulk) instead of\n");
+    fprintf(stderr, "                             one count table per sample\n");
+    fprintf(stderr, "         -S, --seed INT      seed of the generator [42]\n");
+    fprintf(stderr, "         -l, --level INT     gzip compression level [1]\n");
+    fprintf(stderr, "         -t, --threads INT   number of threads [1]\n");
+    fprintf(stderr, "         -h, --help          print this help message\n\n");
+    fprintf(stderr, "The tables are written in output_prefix.sampleN.tsv.gz, or in\n");
+    fprintf(stderr, "output_prefix.matrix.tsv.gz with --matrix. The same options and seed always\n");
+    fprintf(stderr, "give the same files, whatever the number of threads.\n");
+		return 1;
+  }
 
-  ks = ks_init(fp);
-  while ( dret != '\n' )
-  {
-    ks_getuntil(ks, 0, str, &dret);
-    kputs(str->s,kmer);
-    char * sample_name = str->s;
-    sample_ids[nsamples] = add_sample(db, sample_name);
-    ++nsamples;
-    if ( nsamples == capacity ) {
-      capacity += 10;
-      sample_ids = (uint16_t*)realloc (sample_ids,capacity*sizeof(uint16_t));
-			
+  // Open the output files, with the header of the matrix
+  string prefix = argv[optind];
+  vector<FILE*> files;
+  vector<string> paths;
+  if(config.matrix) {
+    paths.push_back(prefix + ".matrix.tsv.gz");
+  } else {
+    for (int j = 0; j < config.nb_samples; j++)
+      paths.push_back(prefix + ".sample" + to_string(j + 1) + ".tsv.gz");
+  }
+  for (size_t i = 0; i < paths.size(); i++) {
+    FILE* f = fopen(paths[i].c_str(), "wb");
+    if(!f) {
+      cerr << "Failed to open " << paths[i] << endl;
+      exit(1);
     }
+    files.push_back(f);
+  }
+  if(config.matrix) {
+    string header = "kmer", member;
+    for (int j = 0; j < config.nb_samples; j++)
+      header += "\tsample" + to_string(j + 1);
+    header += '\n';
+    gz_member(header, level, member);
+    fwrite(member.data(), 1, member.size(), files[0]);
   }
 
-  size_t i = 0;
-  count = (uint16_t*)calloc(nsamples,sizeof(uint16_t));
-  while (ks_getuntil(ks, 0, str, &dret) >= 0) {
-    kputs(str->s,kmer);
-    kmer_int = str_to_int(str->s);
-    if ( i >= nsamples-1 )
-      i = 0;
-    if(dret != '\n') {
-      while ((i < nsamples) && ks_getuntil(ks, 0, str, &dret) > 0 && isdigit(str->s[0]) ) {
-        count_int = atoi(str->s);
-				
-        if(count_int > UINT16_MAX)
-          count[i] = UINT16_MAX;
-        else
-          count[i] = (uint16_t)count_int;
-        ++i;
-      }			
-					
-      rocksdb::Slice key((char*)&kmer_int, sizeof(uint64_t));
-      
-      count_t * counts;
-      size_t nb_counts = nsamples ;
-      
-      rocksdb::Status s = db->counts_db->Get(rocksdb::ReadOptions(), key, &value);
-
-      if(s.ok()) {
-        nb_counts = (value.size() / sizeof(count_t)) + nsamples ;
-        counts = (count_t*)malloc(sizeof(count_t) * nb_counts);
-        memcpy(counts,value.data(),value.size());
-      } else {
-         counts = (count_t*)malloc(sizeof(count_t)*nb_counts);
-      }
-      
-			size_t l = 0;
-      for (size_t i = 0; i < nsamples; ++i) {
-				if (count[i] != 0) {
-        	counts[nb_counts-nsamples+l] = { sample_ids[i], count[i] };
-					++l;
-				}
-			}
-
-      rocksdb::Slice counts_value((char*)counts, l * sizeof(count_t));
-
-      if(batch_i < BUFFER_SIZE) {
-        batch.Put(key, counts_value);
-        ++batch_i;
-      }
-
-      if(batch_i == BUFFER_SIZE ) {
-        s = db->counts_db->Write(rocksdb::WriteOptions(), &batch);
-        if(!s.ok()) {
-          cerr << s.ToString() << endl;
-          exit(4);
-        }
-       batch.Clear();
-       batch_i = 0;
-     }
-     free(counts);
+  // The chunks are generated and compressed by the threads, and written in
+  // order by the main thread
+  size_t nb_chunks = (config.nb_kmers + KAD_GEN_CHUNK - 1) / KAD_GEN_CHUNK;
+  vector< vector<string> > outputs(nb_chunks);
+  vector<char> done(nb_chunks, 0);
+  size_t next_chunk = 0, nb_written = 0;
+  mutex m;
+  condition_variable cv;
+  double start = kad_realtime();
+
+  auto worker = [&]() {
+    vector<string> text(files.size());
+    for (;;) {
+      size_t chunk;
+      {
+        unique_lock<mutex> lock(m);
+        cv.wait(lock, [&] { return next_chunk < nb_written + 4 * (size_t)nb_threads; });
+        if(next_chunk >= nb_chunks)
+          return;
+        chunk = next_chunk++;
+      }
+      uint64_t first = chunk * KAD_GEN_CHUNK;
+      for (size_t i = 0; i < text.size(); i++)
+        text[i].clear();
+      kad_gen_chunk(&config, first, min(first + KAD_GEN_CHUNK, config.nb_kmers), text);
+      vector<string> members(files.size());
+      for (size_t i = 0; i < text.size(); i++) {
+        if(!text[i].empty())
+          gz_member(text[i], level, members[i]);
+      }
+
+      unique_lock<mutex> lock(m);
+      outputs[chunk].swap(members);
+      done[chunk] = 1;
+      cv.notify_all();
     }
-     kmer->l = 0;
-     nb_kmers++;
-     if(nb_kmers % NB_KMERS_PRINT == 0)
-      cerr << nb_kmers  << " kmers loaded" << endl; 
+  };
+
+  vector<thread> threads;
+  for (int i = 0; i < nb_threads; i++)
+    threads.push_back(thread(worker));
+
+  for (size_t chunk = 0; chunk < nb_chunks; chunk++) {
+    vector<string> members;
+    {
+      unique_lock<mutex> lock(m);
+      cv.wait(lock, [&] { return done[chunk] != 0; });
+      members.swap(outputs[chunk]);
+      nb_written++;
+      cv.notify_all();
+    }
+    for (size_t i = 0; i < members.size(); i++)
+      fwrite(members[i].data(), 1, members[i].size(), files[i]);
   }
 
-  if (batch_i < BUFFER_SIZE) {
-     db->counts_db->Write(rocksdb::WriteOptions(), &batch);
-     batch.Clear();
+  for (int i = 0; i < nb_threads; i++)
+    threads[i].join();
+  for (size_t i = 0; i < files.size(); i++) {
+    if(fclose(files[i]) != 0) {
+      cerr << "Failed to write " << paths[i] << endl;
+      exit(1);
+    }
   }
 
-  cerr << "Successfully loaded " << nb_kmers << " kmers" << endl;
-
-  ks_destroy(ks);
-  gzclose(fp);
-  free(str->s); free(str);
-  free(kmer->s); free(kmer);
-  free(count);
-	free(sample_ids);
+  double elapsed = kad_realtime() - start;
+  fprintf(stderr, "Generated %" PRIu64 " k-mers for %d samples in %.2f s (%.0f kmers/s)\n",
+      config.nb_kmers, config.nb_samples, elapsed, config.nb_kmers / max(elapsed, 1e-9));
   return 0;
 }
 
@@ -548,39 +3721,163 @@ int kad_index_bulk(kad_db_t* db, int argc, char **argv)
 static int usage()
 {
 	fprintf(stderr, "\n");
-	fprintf(stderr, "Usage:   kad <command> <arguments>\n");
+	fprintf(stderr, "Usage:   kad [options] <command> <arguments>\n");
 	fprintf(stderr, "Version: %s\n\n", KAD_VERSION);
 	fprintf(stderr, "Command: index      Index k-mer counts from a samples\n");
 	fprintf(stderr, "         index_bulk Index k-mer counts from samples\n");
-	fprintf(stderr, "         query      Query the KAD database\n");
+	fprintf(stderr, "         query      Query the KAD database (exact or with mismatches)\n");
+	fprintf(stderr, "         profile    Count the k-mers of sequences in every sample\n");
 	fprintf(stderr, "         dump       Dump the KAD database\n");
+	fprintf(stderr, "         extract    Extract the k-mers of samples (union, intersection, difference)\n");
+	fprintf(stderr, "         diff       K-mers differentially present between two groups of samples\n");
+	fprintf(stderr, "         top        Most abundant or most shared k-mers\n");
+	fprintf(stderr, "         set        K-mers of a set expression over samples (e.g. (A & B) - C)\n");
 	fprintf(stderr, "         samples    List of the samples\n");
 	fprintf(stderr, "         info       Get informations about the database\n");
+	fprintf(stderr, "         optimize   Compact the database after loading a cohort\n");
+	fprintf(stderr, "         sketch     Build the sketch used by approximate queries\n");
+	fprintf(stderr, "         convert    Copy the database with another key layout\n");
+	fprintf(stderr, "         checkpoint Create a copy of the database\n");
+	fprintf(stderr, "         backup     Create an incremental backup of the database\n");
+	fprintf(stderr, "         restore    Restore a backup\n");
+	fprintf(stderr, "         gen        Generate synthetic count tables\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Options: --db PATH         KAD database directory (default: ./%s)\n", KAD_DB_PREFIX);
+	fprintf(stderr, "         --secondary PATH  open the database as a secondary instance keeping its\n");
+	fprintf(stderr, "                           files in PATH, to follow a running indexer\n");
+	fprintf(stderr, "         --in-memory       load the counts in memory before running a read command\n");
+	fprintf(stderr, "         --sync-io         read the blocks of a batch lookup one at a time instead\n");
+	fprintf(stderr, "                           of asynchronously\n");
+	fprintf(stderr, "         --direct-reads    read the counts with O_DIRECT, bypassing the page cache\n");
+	fprintf(stderr, "         --memory SIZE     memory budget of the block cache, memtables and ingest\n");
+	fprintf(stderr, "                           buffers (e.g. 8G)\n");
+	fprintf(stderr, "         --stats           report the memory used at the end of the command\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "Only the index, optimize and sketch commands, and set with --output, open the\n");
+	fprintf(stderr, "database for writing, the other commands can run concurrently on the same\n");
+	fprintf(stderr, "database.\n");
 	fprintf(stderr, "\n");
 	return 1;
 }
 
+/* Commands that write in the database, kad set only writes with --output */
+static int is_write_command(int argc, char **argv)
+{
+  const char* command = argv[0];
+  if(strcmp(command, "set") == 0) {
+    // The options are parsed on a copy, getopt_long() permutes them
+    vector<char*> args(argv, argv + argc);
+    int c, output = 0, saved_opterr = opterr;
+    opterr = 0;
+    while ((c = getopt_long(argc, args.data(), KAD_SET_SHORT_OPTIONS, kad_set_options, NULL)) >= 0)
+      output |= c == 'o';
+    opterr = saved_opterr;
+    optind = 0;
+    return output;
+  }
+  return strcmp(command, "index") == 0 || strcmp(command, "index_bulk") == 0
+    || strcmp(command, "optimize") == 0 || strcmp(command, "sketch") == 0;
+}
+
 int main(int argc, char *argv[])
 {
+  int c;
+  int in_memory = 0, io_flags = 0, stats = 0;
+  size_t memory = 0;
+  char *db_path = NULL, *secondary_path = NULL;
+  static struct option long_options[] = {
+    { "db",           required_argument, 0, 'd' },
+    { "secondary",    required_argument, 0, 's' },
+    { "in-memory",    no_argument,       0, 'm' },
+    { "sync-io",      no_argument,       0, 'y' },
+    { "direct-reads", no_argument,       0, 'r' },
+    { "memory",       required_argument, 0, 'M' },
+    { "stats",        no_argument,       0, 'S' },
+    { 0, 0, 0, 0 }
+  };
+  // Global options stop at the command name
+  while ((c = getopt_long(argc, argv, "+", long_options, NULL)) >= 0) {
+    switch (c) {
+      case 'd': db_path = optarg; break;
+      case 's': secondary_path = optarg; break;
+      case 'm': in_memory = 1; break;
+      case 'y': io_flags |= KAD_SYNC_IO; break;
+      case 'r': io_flags |= KAD_DIRECT_READS; break;
+      case 'M': memory = parse_size(optarg); break;
+      case 'S': stats = 1; break;
+      default: return usage();
+    }
+  }
+  argc -= optind - 1;
+  argv += optind - 1;
+  optind = 0; // Reset getopt for the command options
+
 	if (argc == 1) return usage();
 
-  char cwd[MAXPATHLEN];
-  getcwd(cwd, MAXPATHLEN);
-  kad_db_t* db = kad_open(cwd);
-
-	if (strcmp(argv[1], "index") == 0) kad_index(db, argc-1, argv+1);
-	else if (strcmp(argv[1], "index_bulk") == 0) kad_index_bulk (db,argc, argv+1);
-  else if (strcmp(argv[1], "dump") == 0) kad_dump(db, argc-1, argv+1);
-  else if (strcmp(argv[1], "query") == 0) kad_query(db, argc-1, argv+1);
-  else if (strcmp(argv[1], "random_query") == 0) kad_random_query(db, argc-1, argv+1);
-  else if (strcmp(argv[1], "test") == 0) kad_test(db, argc-1, argv+1);
-  else if (strcmp(argv[1], "samples") == 0) kad_samples(db, argc-1, argv+1);
-  else if (strcmp(argv[1], "info") == 0) kad_info(db, argc-1, argv+1);
+  string default_path;
+  if(!db_path) {
+    char cwd[MAXPATHLEN];
+    getcwd(cwd, MAXPATHLEN);
+    default_path = string(cwd) + "/" + KAD_DB_PREFIX;
+    db_path = (char*)default_path.c_str();
+  }
+
+  if (strcmp(argv[1], "gen") == 0) return kad_gen(argc-1, argv+1);
+
+  // A backup is restored in a new database
+  if (strcmp(argv[1], "restore") == 0) return kad_restore(db_path, argc-1, argv+1);
+
+  int mode = KAD_READ_ONLY;
+  if(is_write_command(argc-1, argv+1))
+    mode = KAD_READ_WRITE;
+  else if(secondary_path)
+    mode = KAD_SECONDARY;
+
+  int created = mode == KAD_READ_WRITE && stat(db_path, &sb) != 0;
+  kad_db_t* db;
+  int status = kad_open(db_path, mode, secondary_path, io_flags, memory, &db);
+  kad_check(status, status == KAD_NOT_FOUND ? 1 : 2);
+  if(created)
+    cerr << "Successfully created KAD directory: " << db_path << endl;
+  if(in_memory) {
+    if(mode == KAD_READ_WRITE) {
+      cerr << "--in-memory cannot be used with the " << argv[1] << " command" << endl;
+      return 1;
+    }
+    kad_check(kad_mem_load(db), 4);
+    const kad_mem_t* mem = db->mem;
+    size_t bytes = mem->keys.size() * sizeof(uint64_t) + mem->offsets.size() * sizeof(uint64_t)
+      + mem->arena.size() * sizeof(count_t) + mem->buckets.size() * sizeof(uint64_t);
+    cerr << "Loaded " << mem->keys.size() << " k-mers in memory (" << (bytes >> 20) << " MB)" << endl;
+  }
+
+  // The exit code of kad is the one of the command
+  int ret;
+	if (strcmp(argv[1], "index") == 0) ret = kad_index(db, argc-1, argv+1);
+	else if (strcmp(argv[1], "index_bulk") == 0) ret = kad_index_bulk(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "dump") == 0) ret = kad_dump(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "diff") == 0) ret = kad_diff(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "top") == 0) ret = kad_top(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "set") == 0) ret = kad_set(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "query") == 0) ret = kad_query(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "random_query") == 0) ret = kad_random_query(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "test") == 0) ret = kad_test(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "samples") == 0) ret = kad_samples(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "info") == 0) ret = kad_info(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "profile") == 0) ret = kad_profile(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "extract") == 0) ret = kad_extract(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "optimize") == 0) ret = kad_optimize(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "sketch") == 0) ret = kad_sketch(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "convert") == 0) ret = kad_convert(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "checkpoint") == 0) ret = kad_checkpoint(db, argc-1, argv+1);
+  else if (strcmp(argv[1], "backup") == 0) ret = kad_backup(db, argc-1, argv+1);
 	else {
 		fprintf(stderr, "[main] unrecognized command '%s'. Abort!\n", argv[1]);
-		return 1;
+		ret = 1;
 	}
 
+  if(stats)
+    print_memory_report(db);
   kad_destroy(db);
-	return 0;
+	return ret;
 }
@@ -0,0 +1,1399 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/stat.h> // mkdir()
+#include <sys/file.h> // flock()
+#include <fcntl.h>
+#include <unistd.h> // getpid()
+#include <queue>
+
+#include "libkad_internal.h"
+
+using namespace std;
+
+static thread_local string last_error;
+
+const char* kad_last_error() {
+  return last_error.c_str();
+}
+
+int kad_error(int status, const string& message) {
+  last_error = message;
+  return status;
+}
+
+int kad_status(const rocksdb::Status& s) {
+  if(s.ok())
+    return KAD_OK;
+  last_error = s.ToString();
+  if(s.IsNotFound()) return KAD_NOT_FOUND;
+  if(s.IsIOError()) return KAD_IO_ERROR;
+  if(s.IsCorruption()) return KAD_CORRUPTION;
+  if(s.IsInvalidArgument()) return KAD_INVALID_ARGUMENT;
+  if(s.IsNotSupported()) return KAD_NOT_SUPPORTED;
+  return KAD_ERROR;
+}
+
+uint64_t kad_str_to_kmer(const char* str)
+{
+  uint64_t strint = 0;
+  for (size_t i = 0; i < KMER_LENGTH; i++) {
+    uint8_t curr = 0;
+    switch (str[i]) {
+      case 'A': { curr = DNA_MAP::A; break; }
+      case 'T': { curr = DNA_MAP::T; break; }
+      case 'C': { curr = DNA_MAP::C; break; }
+      case 'G': { curr = DNA_MAP::G; break; }
+    }
+    strint = strint << 2;
+    strint = strint | curr;
+  }
+  return strint;
+}
+
+void kad_kmer_to_str(uint64_t kmer, char* str)
+{
+  static const char bases[4] = { 'A', 'C', 'G', 'T' }; // by DNA_MAP value
+  for (int i = 0; i < KMER_LENGTH; i++)
+    str[i] = bases[(kmer >> (2 * (KMER_LENGTH - 1 - i))) & 3ULL];
+  str[KMER_LENGTH] = '\0';
+}
+
+class KmerKeyComparator : public rocksdb::Comparator {
+  public:
+    int Compare(const rocksdb::Slice& a, const rocksdb::Slice& b) const {
+      uint64_t *kmer_a = (uint64_t*)a.data();
+      uint64_t *kmer_b = (uint64_t*)b.data();
+      if(*kmer_a < *kmer_b) {
+        return -1;
+      } else if(*kmer_b < *kmer_a) {
+        return +1;
+      }
+      return 0;
+    }
+    const char* Name() const { return "KmerKeyComparator"; }
+    void FindShortestSeparator(std::string*, const rocksdb::Slice&) const { }
+    void FindShortSuccessor(std::string*) const { }
+};
+
+int kad_load_counts_config(rocksdb::DB* samples_db, kad_counts_config_t* config) {
+  string value;
+  rocksdb::Status s = samples_db->Get(rocksdb::ReadOptions(), "_counts_options", &value);
+  if(!s.ok() || value.size() != sizeof(kad_counts_config_t))
+    return 0;
+  memcpy(config, value.data(), sizeof(kad_counts_config_t));
+  return 1;
+}
+
+/* Split a memory budget of total bytes */
+kad_memory_t* kad_memory_init(size_t total) {
+  kad_memory_t* memory = new kad_memory_t();
+  memory->total = total;
+  memory->ingest = total / 8;
+  memory->block_cache = total - memory->ingest;
+  memory->write_buffers = memory->block_cache / 4;
+  memory->cache = rocksdb::NewLRUCache(memory->block_cache);
+  memory->write_buffer_manager = std::make_shared<rocksdb::WriteBufferManager>(
+      memory->write_buffers, memory->cache);
+  return memory;
+}
+
+/* Options shared by both databases to stay within the memory budget. The
+ * index and filter blocks are kept in the block cache so that they are
+ * counted in the budget. The memtables are not made smaller than
+ * KAD_MIN_WRITE_BUFFER with a small budget, they would be flushed in a
+ * flood of tiny L0 files */
+void kad_memory_options(const kad_memory_t* memory, rocksdb::Options* options,
+    rocksdb::BlockBasedTableOptions* table_options) {
+  if(!memory)
+    return;
+  options->write_buffer_manager = memory->write_buffer_manager;
+  options->write_buffer_size = min(options->write_buffer_size,
+      max(memory->write_buffers / 4, (size_t)KAD_MIN_WRITE_BUFFER));
+  table_options->block_cache = memory->cache;
+  table_options->cache_index_and_filter_blocks = true;
+  table_options->pin_l0_filter_and_index_blocks_in_cache = true;
+}
+
+rocksdb::Options kad_counts_options(const kad_counts_config_t* config, const kad_memory_t* memory,
+    int layout) {
+  rocksdb::Options options_counts;
+  // The comparator must outlive every database opened with it
+  static const KmerKeyComparator cmp_kmers;
+  if(layout == KAD_LAYOUT_KMER)
+    options_counts.comparator = &cmp_kmers;
+  options_counts.max_open_files = 1000;
+
+  rocksdb::BlockBasedTableOptions table_options;
+  kad_memory_options(memory, &options_counts, &table_options);
+  if(config && config->bloom_bits > 0)
+    table_options.filter_policy.reset(rocksdb::NewBloomFilterPolicy(config->bloom_bits, false));
+  if(memory || (config && config->bloom_bits > 0))
+    options_counts.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options));
+
+  if(config) {
+    options_counts.bottommost_compression = (rocksdb::CompressionType)config->compression;
+    options_counts.bottommost_compression_opts.enabled = true;
+    options_counts.bottommost_compression_opts.level = config->level;
+    options_counts.bottommost_compression_opts.max_dict_bytes = config->dict_bytes;
+    options_counts.bottommost_compression_opts.zstd_max_train_bytes = config->dict_bytes * 100;
+  }
+  return options_counts;
+}
+
+rocksdb::Status kad_open_db(const rocksdb::Options& options, const string& path,
+    const char* secondary_path, const char* name, int mode, rocksdb::DB** db,
+    rocksdb::ColumnFamilyHandle** sample_major) {
+  // Every column family of an existing database has to be opened. The
+  // sample-major column family keeps the default bytewise order
+  vector<string> names;
+  rocksdb::DB::ListColumnFamilies(options, path, &names);
+  vector<rocksdb::ColumnFamilyDescriptor> families;
+  families.push_back(rocksdb::ColumnFamilyDescriptor(rocksdb::kDefaultColumnFamilyName, options));
+  for (size_t i = 0; i < names.size(); i++) {
+    if(names[i] != rocksdb::kDefaultColumnFamilyName)
+      families.push_back(rocksdb::ColumnFamilyDescriptor(names[i], rocksdb::ColumnFamilyOptions()));
+  }
+
+  rocksdb::Status s;
+  vector<rocksdb::ColumnFamilyHandle*> handles;
+  if(mode == KAD_READ_ONLY) {
+    s = rocksdb::DB::OpenForReadOnly(options, path, families, &handles, db);
+  } else if(mode == KAD_SECONDARY) {
+    string instance_path = string(secondary_path) + "/" + name;
+    mkdir(secondary_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    mkdir(instance_path.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    rocksdb::Options secondary_options = options;
+    // A secondary instance has to keep all the files opened to follow the primary
+    secondary_options.max_open_files = -1;
+    s = rocksdb::DB::OpenAsSecondary(secondary_options, path, instance_path, families, &handles, db);
+  } else {
+    s = rocksdb::DB::Open(options, path, families, &handles, db);
+  }
+  if(!s.ok())
+    return s;
+
+  if(sample_major)
+    *sample_major = NULL;
+  for (size_t i = 0; i < handles.size(); i++) {
+    if(sample_major && handles[i]->GetName() == KAD_SAMPLE_MAJOR)
+      *sample_major = handles[i];
+    else
+      (*db)->DestroyColumnFamilyHandle(handles[i]);
+  }
+  return s;
+}
+
+/* An empty sketch of about bytes bytes */
+kad_sketch_t* kad_sketch_new(size_t bytes) {
+  size_t block_bytes = KAD_SKETCH_ROWS * KAD_SKETCH_WIDTH * sizeof(uint16_t);
+  kad_sketch_t* sketch = new kad_sketch_t();
+  sketch->nb_blocks = max(bytes / block_bytes, (size_t)1);
+  sketch->cells.assign(sketch->nb_blocks * KAD_SKETCH_ROWS * KAD_SKETCH_WIDTH, 0);
+  return sketch;
+}
+
+/* Load the sketch of the database, if it covers all its samples. The sketch
+ * of an interrupted index run does not, and is ignored until "kad sketch"
+ * builds it again */
+int kad_sketch_load(kad_db_t* db) {
+  string path = string(db->path) + "/" + KAD_SKETCH_FILE;
+  uint32_t nb_samples = kad_nb_samples(db);
+  if(db->sketch && db->sketch->nb_samples == nb_samples)
+    return KAD_OK;
+  delete db->sketch;
+  db->sketch = NULL;
+
+  FILE* fp = fopen(path.c_str(), "rb");
+  if(!fp)
+    return KAD_OK;
+  char magic[8];
+  uint32_t header_samples;
+  uint64_t nb_blocks;
+  int status = KAD_OK;
+  if(fread(magic, sizeof(magic), 1, fp) != 1 || memcmp(magic, KAD_SKETCH_MAGIC, sizeof(magic)) != 0
+      || fread(&header_samples, sizeof(uint32_t), 1, fp) != 1 || fread(&nb_blocks, sizeof(uint64_t), 1, fp) != 1) {
+    status = kad_error(KAD_CORRUPTION, "Invalid sketch file: " + path);
+  } else if(header_samples == nb_samples) {
+    kad_sketch_t* sketch = new kad_sketch_t();
+    sketch->nb_blocks = nb_blocks;
+    sketch->nb_samples = header_samples;
+    sketch->cells.resize(nb_blocks * KAD_SKETCH_ROWS * KAD_SKETCH_WIDTH);
+    if(fread(sketch->cells.data(), sizeof(uint16_t), sketch->cells.size(), fp) != sketch->cells.size()) {
+      delete sketch;
+      status = kad_error(KAD_CORRUPTION, "Truncated sketch file: " + path);
+    } else {
+      db->sketch = sketch;
+    }
+  }
+  fclose(fp);
+  return status;
+}
+
+/* Write the sketch as covering all the samples of the database. It is
+ * written to a temporary file first, so readers never load a partial one */
+int kad_sketch_save(kad_db_t* db) {
+  string path = string(db->path) + "/" + KAD_SKETCH_FILE;
+  string tmp_path = path + ".tmp";
+  kad_sketch_t* sketch = db->sketch;
+  sketch->nb_samples = kad_nb_samples(db);
+  FILE* fp = fopen(tmp_path.c_str(), "wb");
+  if(!fp)
+    return kad_error(KAD_IO_ERROR, "Failed to create " + tmp_path);
+  int ok = fwrite(KAD_SKETCH_MAGIC, 8, 1, fp) == 1
+    && fwrite(&sketch->nb_samples, sizeof(uint32_t), 1, fp) == 1
+    && fwrite(&sketch->nb_blocks, sizeof(uint64_t), 1, fp) == 1
+    && fwrite(sketch->cells.data(), sizeof(uint16_t), sketch->cells.size(), fp) == sketch->cells.size();
+  ok = fclose(fp) == 0 && ok;
+  if(!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    remove(tmp_path.c_str());
+    return kad_error(KAD_IO_ERROR, "Failed to write " + path);
+  }
+  return KAD_OK;
+}
+
+int kad_approx(kad_db_t* db, size_t n, const uint64_t* keys, uint16_t* bounds) {
+  if(!db->sketch)
+    return kad_error(KAD_NOT_SUPPORTED, "The database has no sketch covering all its samples (see kad sketch)");
+  for (size_t i = 0; i < n; i++)
+    bounds[i] = kad_sketch_get(db->sketch, keys[i]);
+  return KAD_OK;
+}
+
+int kad_open(const char* db_path, int mode, const char* secondary_path, int io_flags, size_t memory,
+    kad_db_t** db) {
+  struct stat sb;
+  *db = NULL;
+  if (stat(db_path, &sb) != 0) {
+    if (mode != KAD_READ_WRITE)
+      return kad_error(KAD_NOT_FOUND, string("No KAD database found at: ") + db_path);
+    if (mkdir(db_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
+      return kad_error(KAD_IO_ERROR, string("Failed to create KAD directory: ") + db_path);
+  }
+  else if (!S_ISDIR(sb.st_mode)) {
+    return kad_error(KAD_INVALID_ARGUMENT, string("KAD database is not a directory: ") + db_path);
+  }
+
+  kad_db_t* kad_db = new kad_db_t();
+  kad_db->path = strdup(db_path);
+  kad_db->mode = mode;
+  kad_db->io_flags = io_flags;
+  kad_db->memory = memory > 0 ? kad_memory_init(memory) : NULL;
+  kad_db->last_catch_up = time(NULL);
+  kad_db->backend = &kad_rocksdb_backend;
+
+  rocksdb::Options options_samples;
+  rocksdb::BlockBasedTableOptions table_options_samples;
+  kad_memory_options(kad_db->memory, &options_samples, &table_options_samples);
+  if(kad_db->memory)
+    options_samples.table_factory.reset(rocksdb::NewBlockBasedTableFactory(table_options_samples));
+
+  if(mode == KAD_READ_WRITE) {
+    options_samples.create_if_missing = true;
+  }
+
+  rocksdb::Status status;
+
+  status = kad_open_db(options_samples, string(db_path) + "/samples", secondary_path, "samples", mode, &kad_db->samples_db, NULL);
+  if(!status.ok()) {
+    kad_destroy(kad_db);
+    int ret = kad_status(status);
+    return kad_error(ret, "Failed to open samples database: " + status.ToString());
+  }
+
+  // The header gives the layout, which is needed to open counts_db
+  int ret = kad_load_samples(kad_db);
+  if(ret != KAD_OK) {
+    kad_destroy(kad_db);
+    return ret;
+  }
+
+  kad_counts_config_t config;
+  int has_config = kad_load_counts_config(kad_db->samples_db, &config);
+  rocksdb::Options options_counts = kad_counts_options(has_config ? &config : NULL, kad_db->memory,
+      kad_db->layout);
+  options_counts.use_direct_reads = (io_flags & KAD_DIRECT_READS) != 0;
+  if(mode == KAD_READ_WRITE)
+    options_counts.create_if_missing = true;
+
+  status = kad_open_db(options_counts, string(db_path) + "/counts", secondary_path, "counts", mode, &kad_db->counts_db, &kad_db->sample_major);
+  if(!status.ok()) {
+    kad_destroy(kad_db);
+    int ret = kad_status(status);
+    return kad_error(ret, "Failed to open counts database: " + status.ToString());
+  }
+
+  ret = kad_sketch_load(kad_db);
+  if(ret != KAD_OK) {
+    kad_destroy(kad_db);
+    return ret;
+  }
+
+  *db = kad_db;
+  return KAD_OK;
+}
+
+int kad_create(const char* db_path, int layout) {
+  struct stat sb;
+  if (stat(db_path, &sb) == 0)
+    return kad_error(KAD_INVALID_ARGUMENT, string("A file or directory already exists at: ") + db_path);
+  if (mkdir(db_path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) != 0)
+    return kad_error(KAD_IO_ERROR, string("Failed to create KAD directory: ") + db_path);
+
+  // The layout is read from the header before counts_db is opened
+  rocksdb::Options options_samples;
+  options_samples.create_if_missing = true;
+  rocksdb::DB* samples_db;
+  rocksdb::Status s = rocksdb::DB::Open(options_samples, string(db_path) + "/samples", &samples_db);
+  if(!s.ok())
+    return kad_status(s);
+  kad_header_t header;
+  kad_header_init(&header, layout);
+  rocksdb::WriteBatch batch;
+  batch.Put("_header", rocksdb::Slice((char*)&header, sizeof(kad_header_t)));
+  // Read by the versions of kad older than the header
+  if(layout == KAD_LAYOUT_MINIMIZER)
+    batch.Put("_key_layout", "minimizer");
+  s = samples_db->Write(rocksdb::WriteOptions(), &batch);
+  delete samples_db;
+  return kad_status(s);
+}
+
+/* Replay the latest writes of the primary on a secondary instance, at most
+ * once every KAD_CATCH_UP_INTERVAL seconds */
+int kad_catch_up(kad_db_t *db) {
+  if(db->mode != KAD_SECONDARY || db->mem || time(NULL) - db->last_catch_up < KAD_CATCH_UP_INTERVAL)
+    return KAD_OK;
+  rocksdb::Status s = db->samples_db->TryCatchUpWithPrimary();
+  if(s.ok())
+    s = db->counts_db->TryCatchUpWithPrimary();
+  db->last_catch_up = time(NULL);
+  if(!s.ok())
+    return kad_status(s);
+  int status = kad_load_samples(db);
+  // The sketch is dropped, or loaded again, when the primary added samples
+  return status == KAD_OK ? kad_sketch_load(db) : status;
+}
+
+void kad_destroy(kad_db_t *db) {
+  delete db->mem;
+  delete db->samples_db;
+  if(db->sample_major)
+    db->counts_db->DestroyColumnFamilyHandle(db->sample_major);
+  delete db->counts_db;
+  delete db->memory;
+  delete db->sketch;
+  free(db->path);
+  delete db;
+}
+
+/* Copy the whole counts database in memory with one sequential scan. The
+ * memory backend is read-only, and does not follow a primary */
+int kad_mem_load(kad_db_t* db) {
+  kad_mem_t* mem = new kad_mem_t();
+  uint64_t nb_keys = 0;
+  db->counts_db->GetIntProperty("rocksdb.estimate-num-keys", &nb_keys);
+  mem->keys.reserve(nb_keys);
+  mem->offsets.reserve(nb_keys + 1);
+
+  rocksdb::ReadOptions read_options;
+  read_options.fill_cache = false;
+  rocksdb::Iterator* it = db->counts_db->NewIterator(read_options);
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    const count_t* counts = (const count_t*)it->value().data();
+    mem->keys.push_back(kad_key_kmer(db, it->key()));
+    mem->offsets.push_back(mem->arena.size());
+    mem->arena.insert(mem->arena.end(), counts, counts + it->value().size() / sizeof(count_t));
+  }
+  int status = kad_status(it->status());
+  delete it;
+  if(status != KAD_OK) {
+    delete mem;
+    return status;
+  }
+  mem->offsets.push_back(mem->arena.size());
+
+  // The keys of the minimizer layout are sorted by k-mer
+  if(!is_sorted(mem->keys.begin(), mem->keys.end())) {
+    vector<uint64_t> order(mem->keys.size());
+    for (size_t i = 0; i < order.size(); i++) order[i] = i;
+    sort(order.begin(), order.end(), [mem](uint64_t a, uint64_t b) { return mem->keys[a] < mem->keys[b]; });
+    kad_mem_t* sorted = new kad_mem_t();
+    sorted->keys.reserve(mem->keys.size());
+    sorted->offsets.reserve(mem->offsets.size());
+    sorted->arena.reserve(mem->arena.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      sorted->keys.push_back(mem->keys[order[i]]);
+      sorted->offsets.push_back(sorted->arena.size());
+      sorted->arena.insert(sorted->arena.end(), mem->arena.begin() + mem->offsets[order[i]],
+          mem->arena.begin() + mem->offsets[order[i] + 1]);
+    }
+    sorted->offsets.push_back(sorted->arena.size());
+    delete mem;
+    mem = sorted;
+  }
+
+  // About one key per bucket
+  nb_keys = mem->keys.size();
+  mem->bucket_bits = 1;
+  while(mem->bucket_bits < 32 && (1ULL << mem->bucket_bits) < nb_keys)
+    mem->bucket_bits++;
+  size_t nb_buckets = 1ULL << mem->bucket_bits;
+  mem->buckets.assign(nb_buckets + 1, nb_keys);
+  for (size_t i = nb_keys; i-- > 0;)
+    mem->buckets[mem->keys[i] >> (64 - mem->bucket_bits)] = i;
+  for (size_t b = nb_buckets; b-- > 0;)
+    mem->buckets[b] = min(mem->buckets[b], mem->buckets[b + 1]);
+
+  db->mem = mem;
+  db->backend = &kad_mem_backend;
+  return KAD_OK;
+}
+
+/* Look up n keys sorted in increasing order. The counts of the batch are
+ * valid until the next lookup with the same batch */
+int kad_multi_get(kad_db_t* db, kad_batch_t* batch, size_t n, const uint64_t* keys) {
+  batch->counts.assign(n, NULL);
+  batch->nb_counts.assign(n, 0);
+  return db->backend->multi_get(db, batch, n, keys);
+}
+
+static int kad_rocksdb_multi_get(kad_db_t* db, kad_batch_t* batch, size_t n, const uint64_t* keys) {
+  // The keys absent from the sketch are definite misses, and do not reach
+  // RocksDB
+  batch->slices.resize(n);
+  batch->positions.resize(n);
+  batch->key_bytes.resize(n * KAD_KEY_MAX_BYTES);
+  size_t m = 0, key_size = 0;
+  for (size_t i = 0; i < n; i++) {
+    if(db->sketch && kad_sketch_get(db->sketch, keys[i]) == 0)
+      continue;
+    key_size = kad_key(db, keys[i], &batch->key_bytes[i * KAD_KEY_MAX_BYTES]).size();
+    batch->positions[m++] = i;
+  }
+  // MultiGet takes the keys in the order of the layout
+  if(db->layout != KAD_LAYOUT_KMER) {
+    const char* bytes = batch->key_bytes.data();
+    sort(batch->positions.begin(), batch->positions.begin() + m, [bytes](uint32_t a, uint32_t b) {
+      return memcmp(bytes + a * KAD_KEY_MAX_BYTES, bytes + b * KAD_KEY_MAX_BYTES, KAD_KEY_MAX_BYTES) < 0;
+    });
+  }
+  for (size_t j = 0; j < m; j++)
+    batch->slices[j] = rocksdb::Slice(&batch->key_bytes[batch->positions[j] * KAD_KEY_MAX_BYTES], key_size);
+  batch->statuses.resize(m);
+  for (size_t i = 0; i < batch->pinned.size(); i++)
+    batch->pinned[i].Reset();
+  if(batch->pinned.size() < m)
+    batch->pinned.resize(m);
+  if(m == 0)
+    return KAD_OK;
+  rocksdb::ReadOptions read_options;
+  read_options.async_io = !(db->io_flags & KAD_SYNC_IO);
+  read_options.optimize_multiget_for_io = true;
+  read_options.fill_cache = !(db->io_flags & KAD_NO_FILL_CACHE);
+  db->counts_db->MultiGet(read_options, db->counts_db->DefaultColumnFamily(),
+      m, batch->slices.data(), batch->pinned.data(), batch->statuses.data(), true);
+  for (size_t j = 0; j < m; j++) {
+    size_t i = batch->positions[j];
+    if(batch->statuses[j].ok()) {
+      batch->counts[i] = (const count_t*)batch->pinned[j].data();
+      batch->nb_counts[i] = batch->pinned[j].size() / sizeof(count_t);
+    } else if(!batch->statuses[j].IsNotFound()) {
+      return kad_status(batch->statuses[j]);
+    }
+  }
+  return KAD_OK;
+}
+
+int kad_lookup(kad_db_t* db, size_t n, const uint64_t* keys, count_t* counts, size_t capacity,
+    size_t* offsets) {
+  kad_batch_t batch;
+  int status = kad_multi_get(db, &batch, n, keys);
+  if(status != KAD_OK)
+    return status;
+  offsets[0] = 0;
+  for (size_t i = 0; i < n; i++)
+    offsets[i + 1] = offsets[i] + batch.nb_counts[i];
+  if(offsets[n] > capacity)
+    return kad_error(KAD_BUFFER_TOO_SMALL, "The counts do not fit in the buffer");
+  for (size_t i = 0; i < n; i++)
+    memcpy(counts + offsets[i], batch.counts[i], batch.nb_counts[i] * sizeof(count_t));
+  return KAD_OK;
+}
+
+uint64_t kad_key_position(kad_db_t* db, uint64_t kmer) {
+  return db->backend->key_position(db, kmer);
+}
+
+int kad_iterator_new(kad_db_t* db, uint64_t first, uint64_t last, kad_iterator_t** it) {
+  kad_iterator_t* iter = new kad_iterator_t();
+  iter->db = db;
+  iter->first = first;
+  iter->last = last;
+  db->backend->iterator_init(iter);
+  *it = iter;
+  return KAD_OK;
+}
+
+int kad_iterator_next(kad_iterator_t* it, uint64_t* kmer, const count_t** counts, size_t* nb_counts) {
+  return it->db->backend->iterator_next(it, kmer, counts, nb_counts);
+}
+
+void kad_iterator_destroy(kad_iterator_t* it) {
+  it->db->backend->iterator_free(it);
+  delete it;
+}
+
+static uint64_t kad_rocksdb_key_position(kad_db_t* db, uint64_t kmer) {
+  if(db->layout == KAD_LAYOUT_KMER)
+    return kmer;
+  return ((uint64_t)kad_minimizer(kmer) << 40) | (kmer >> 24);
+}
+
+/* The RocksDB iterator seeks to the first position at the first call of
+ * next, so that creating it does no IO */
+static void kad_rocksdb_iterator_init(kad_iterator_t* it) {
+  rocksdb::ReadOptions read_options;
+  it->end_slice = kad_position_key(it->db, it->last + 1, it->end_buf);
+  if(it->last < UINT64_MAX)
+    read_options.iterate_upper_bound = &it->end_slice;
+  it->it = it->db->counts_db->NewIterator(read_options);
+  it->started = 0;
+}
+
+static int kad_rocksdb_iterator_next(kad_iterator_t* it, uint64_t* kmer, const count_t** counts,
+    size_t* nb_counts) {
+  if(it->started) {
+    it->it->Next();
+  } else {
+    char buf[KAD_KEY_MAX_BYTES];
+    it->it->Seek(kad_position_key(it->db, it->first, buf));
+    it->started = 1;
+  }
+  if(!it->it->Valid())
+    return kad_status(it->it->status());
+  *kmer = kad_key_kmer(it->db, it->it->key());
+  *counts = (const count_t*)it->it->value().data();
+  *nb_counts = it->it->value().size() / sizeof(count_t);
+  return 1;
+}
+
+static void kad_rocksdb_iterator_free(kad_iterator_t* it) {
+  delete it->it;
+  it->it = NULL;
+}
+
+const kad_backend_t kad_rocksdb_backend = {
+  "rocksdb",
+  kad_rocksdb_multi_get,
+  kad_rocksdb_key_position,
+  kad_rocksdb_iterator_init,
+  kad_rocksdb_iterator_next,
+  kad_rocksdb_iterator_free
+};
+
+/* The memory backend is always in k-mer order, whatever the layout of
+ * counts_db */
+static int kad_mem_multi_get(kad_db_t* db, kad_batch_t* batch, size_t n, const uint64_t* keys) {
+  const kad_mem_t* mem = db->mem;
+  for (size_t i = 0; i < n; i++) {
+    size_t k = kad_mem_lower_bound(mem, keys[i]);
+    if(k < mem->keys.size() && mem->keys[k] == keys[i]) {
+      batch->counts[i] = mem->arena.data() + mem->offsets[k];
+      batch->nb_counts[i] = mem->offsets[k + 1] - mem->offsets[k];
+    }
+  }
+  return KAD_OK;
+}
+
+static uint64_t kad_mem_key_position(kad_db_t*, uint64_t kmer) {
+  return kmer;
+}
+
+static void kad_mem_iterator_init(kad_iterator_t* it) {
+  it->it = NULL;
+  it->k = kad_mem_lower_bound(it->db->mem, it->first);
+}
+
+static int kad_mem_iterator_next(kad_iterator_t* it, uint64_t* kmer, const count_t** counts,
+    size_t* nb_counts) {
+  const kad_mem_t* mem = it->db->mem;
+  if(it->k >= mem->keys.size() || mem->keys[it->k] > it->last)
+    return 0;
+  *kmer = mem->keys[it->k];
+  *counts = mem->arena.data() + mem->offsets[it->k];
+  *nb_counts = mem->offsets[it->k + 1] - mem->offsets[it->k];
+  it->k++;
+  return 1;
+}
+
+static void kad_mem_iterator_free(kad_iterator_t*) {
+}
+
+const kad_backend_t kad_mem_backend = {
+  "memory",
+  kad_mem_multi_get,
+  kad_mem_key_position,
+  kad_mem_iterator_init,
+  kad_mem_iterator_next,
+  kad_mem_iterator_free
+};
+
+/* Bytes of the write batches and of the bulk runs, reduced to fit in the
+ * ingest share of the memory budget */
+size_t kad_ingest_bytes(kad_db_t* db, size_t default_bytes) {
+  if(!db->memory)
+    return default_bytes;
+  return min(default_bytes, max(db->memory->ingest / 2, (size_t)1 << 20));
+}
+
+void kad_header_init(kad_header_t* header, int layout) {
+  memset(header, 0, sizeof(kad_header_t));
+  memcpy(header->magic, KAD_HEADER_MAGIC, sizeof(KAD_HEADER_MAGIC));
+  header->format_version = KAD_FORMAT_VERSION;
+  header->k = KMER_LENGTH;
+  header->canonical = 0;
+  header->value_format = KAD_VALUE_FORMAT;
+  header->key_layout = layout;
+}
+
+string sample_record_key(uint16_t id) {
+  string key((char*)&id, sizeof(uint16_t));
+  key += "record";
+  return key;
+}
+
+string sample_totals_key(uint16_t id) {
+  string key((char*)&id, sizeof(uint16_t));
+  key += "totals";
+  return key;
+}
+
+string sample_hist_key(uint16_t id) {
+  string key((char*)&id, sizeof(uint16_t));
+  key += "hist";
+  return key;
+}
+
+/* Read the header and the samples of samples_db in db. The samples added
+ * by a kad older than the header only update "_nb_keys", and have their
+ * totals under id + "totals": they are converted to records, and written
+ * back when the database is opened for writing */
+int kad_load_samples(kad_db_t* db) {
+  string value;
+  rocksdb::ReadOptions read_options;
+  int has_header = db->samples_db->Get(read_options, "_header", &value).ok();
+  if(has_header) {
+    if(value.size() < sizeof(kad_header_t) || memcmp(value.data(), KAD_HEADER_MAGIC, sizeof(KAD_HEADER_MAGIC)) != 0)
+      return kad_error(KAD_CORRUPTION, "Invalid header in the samples database");
+    memcpy(&db->header, value.data(), sizeof(kad_header_t));
+    if(db->header.format_version > KAD_FORMAT_VERSION || db->header.value_format != KAD_VALUE_FORMAT
+        || db->header.key_layout > KAD_LAYOUT_MINIMIZER)
+      return kad_error(KAD_NOT_SUPPORTED, "The database was written by a newer version of kad (format "
+          + to_string(db->header.format_version) + ")");
+    if(db->header.k != KMER_LENGTH || db->header.canonical)
+      return kad_error(KAD_NOT_SUPPORTED, "The database has " + string(db->header.canonical ? "canonical " : "")
+          + to_string(db->header.k) + "-mers, this kad only reads " + to_string(KMER_LENGTH) + "-mers");
+  } else {
+    int minimizer = db->samples_db->Get(read_options, "_key_layout", &value).ok() && value == "minimizer";
+    kad_header_init(&db->header, minimizer ? KAD_LAYOUT_MINIMIZER : KAD_LAYOUT_KMER);
+  }
+  db->layout = db->header.key_layout;
+
+  uint32_t nb_samples = 0;
+  int upgrade = !has_header;
+  if(db->samples_db->Get(read_options, "_next_id", &value).ok() && value.size() == sizeof(uint32_t))
+    memcpy(&nb_samples, value.data(), sizeof(uint32_t));
+  else
+    upgrade = 1;
+  if(db->samples_db->Get(read_options, "_nb_keys", &value).ok() && (uint32_t)atoi(value.c_str()) != nb_samples) {
+    nb_samples = max(nb_samples, (uint32_t)atoi(value.c_str()));
+    upgrade = 1;
+  }
+
+  // The keys of a sample start with its id
+  vector<kad_sample_t> samples(nb_samples);
+  vector<char> has_record(nb_samples, 0), has_totals(nb_samples, 0), has_progress(nb_samples, 0);
+  rocksdb::Iterator* it = db->samples_db->NewIterator(read_options);
+  for (it->SeekToFirst(); it->Valid(); it->Next()) {
+    rocksdb::Slice key = it->key();
+    uint16_t id;
+    if(key.size() < sizeof(uint16_t))
+      continue;
+    memcpy(&id, key.data(), sizeof(uint16_t));
+    if(id >= nb_samples)
+      continue;
+    key.remove_prefix(sizeof(uint16_t));
+    if(key.empty()) {
+      samples[id].name = it->value().ToString();
+    } else if(key == "record" && it->value().size() == sizeof(kad_sample_info_t)) {
+      memcpy(&samples[id].info, it->value().data(), sizeof(kad_sample_info_t));
+      has_record[id] = 1;
+    } else if(key == "totals" && it->value().size() == sizeof(sample_totals_t)) {
+      const sample_totals_t* totals = (const sample_totals_t*)it->value().data();
+      samples[id].info.nb_kmers = totals->nb_kmers;
+      samples[id].info.total_count = totals->total_count;
+      has_totals[id] = 1;
+    } else if(key == "progress") {
+      has_progress[id] = 1;
+    }
+  }
+  int status = kad_status(it->status());
+  delete it;
+  if(status != KAD_OK)
+    return kad_error(status, "failed to read the samples database");
+
+  rocksdb::WriteBatch batch;
+  for (uint32_t id = 0; id < nb_samples; id++) {
+    if(has_record[id])
+      continue;
+    kad_sample_info_t* info = &samples[id].info;
+    info->status = has_progress[id] ? KAD_SAMPLE_INDEXING : has_totals[id] ? KAD_SAMPLE_COMPLETE : KAD_SAMPLE_NO_TOTALS;
+    info->reserved = 0;
+    info->ctime = 0;
+    batch.Put(sample_record_key(id), rocksdb::Slice((char*)info, sizeof(kad_sample_info_t)));
+    if(has_totals[id])
+      batch.Delete(sample_totals_key(id));
+  }
+  if(upgrade && db->mode == KAD_READ_WRITE) {
+    batch.Put("_header", rocksdb::Slice((char*)&db->header, sizeof(kad_header_t)));
+    batch.Put("_next_id", rocksdb::Slice((char*)&nb_samples, sizeof(uint32_t)));
+    batch.Put("_nb_keys", to_string(nb_samples));
+    int lock = kad_lock_samples(db);
+    status = kad_status(db->samples_db->Write(rocksdb::WriteOptions(), &batch));
+    kad_unlock_samples(lock);
+    if(status != KAD_OK)
+      return kad_error(status, "failed to upgrade the samples database");
+  }
+  db->samples.swap(samples);
+  return KAD_OK;
+}
+
+/* The samples are added and completed under an exclusive flock of
+ * KAD_SAMPLES_LOCK_FILE, that kad checkpoint and kad backup hold while they
+ * copy the database: a copy never sees a sample added or completed between
+ * the copies of the samples and of the counts. Returns -1, and the write
+ * goes on unlocked, when the lock file cannot be opened */
+int kad_lock_samples(kad_db_t* db) {
+  string path = string(db->path) + "/" + KAD_SAMPLES_LOCK_FILE;
+  int fd = open(path.c_str(), O_RDONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd >= 0 && flock(fd, LOCK_EX) != 0) {
+    close(fd);
+    fd = -1;
+  }
+  return fd;
+}
+
+void kad_unlock_samples(int lock) {
+  if(lock >= 0)
+    close(lock);
+}
+
+uint32_t kad_nb_samples(kad_db_t* db) {
+  return db->samples.size();
+}
+
+int add_sample(kad_db_t* db, const char* sample_name, uint16_t* id){
+  if(db->samples.size() > UINT16_MAX)
+    return kad_error(KAD_NOT_SUPPORTED, "The database already has the maximum number of samples");
+  uint16_t new_id = db->samples.size();
+  uint32_t nb_samples = new_id + 1;
+  kad_sample_t sample;
+  sample.name = sample_name;
+  sample.info = { KAD_SAMPLE_INDEXING, 0, (int64_t)time(NULL), 0, 0 };
+
+  // The name, the record and the id counter are written atomically
+  rocksdb::WriteBatch batch;
+  batch.Put(rocksdb::Slice((char*)&new_id, sizeof(uint16_t)), sample_name);
+  batch.Put(sample_record_key(new_id), rocksdb::Slice((char*)&sample.info, sizeof(kad_sample_info_t)));
+  batch.Put("_next_id", rocksdb::Slice((char*)&nb_samples, sizeof(uint32_t)));
+  // Read by the versions of kad older than the header
+  batch.Put("_nb_keys", to_string(nb_samples));
+  int lock = kad_lock_samples(db);
+  rocksdb::Status s = db->samples_db->Write(rocksdb::WriteOptions(), &batch);
+  kad_unlock_samples(lock);
+  if(!s.ok()) {
+    int status = kad_status(s);
+    return kad_error(status, "failed to add sample to the database");
+  }
+  db->samples.push_back(sample);
+  *id = new_id;
+  return KAD_OK;
+}
+
+int kad_sample_name(kad_db_t* db, uint16_t id, char* name, size_t size) {
+  if(id >= db->samples.size())
+    return kad_error(KAD_NOT_FOUND, "No sample " + to_string(id) + " in the database");
+  const string& sample_name = db->samples[id].name;
+  if(sample_name.size() >= size)
+    return kad_error(KAD_BUFFER_TOO_SMALL, "The name of sample " + to_string(id) + " does not fit in the buffer");
+  memcpy(name, sample_name.c_str(), sample_name.size() + 1);
+  return KAD_OK;
+}
+
+int kad_sample_info(kad_db_t* db, uint16_t id, kad_sample_info_t* info) {
+  if(id >= db->samples.size())
+    return kad_error(KAD_NOT_FOUND, "No sample " + to_string(id) + " in the database");
+  *info = db->samples[id].info;
+  return KAD_OK;
+}
+
+/* Put the record of the sample id, complete with totals, and its count
+ * histogram if there is one in batch. The record is returned to update the
+ * cache once the batch is written */
+static kad_sample_info_t kad_complete_sample(kad_db_t* db, uint16_t id, const sample_totals_t* totals,
+    const sample_hist_t* hist, rocksdb::WriteBatch* batch) {
+  kad_sample_info_t info = db->samples[id].info;
+  info.status = KAD_SAMPLE_COMPLETE;
+  info.nb_kmers = totals->nb_kmers;
+  info.total_count = totals->total_count;
+  batch->Put(sample_record_key(id), rocksdb::Slice((char*)&info, sizeof(kad_sample_info_t)));
+  if(hist)
+    batch->Put(sample_hist_key(id), rocksdb::Slice((char*)hist, sizeof(sample_hist_t)));
+  return info;
+}
+
+int put_sample_totals(kad_db_t* db, uint16_t id, const sample_totals_t* totals, const sample_hist_t* hist) {
+  rocksdb::WriteBatch batch;
+  kad_sample_info_t info = kad_complete_sample(db, id, totals, hist, &batch);
+  int lock = kad_lock_samples(db);
+  rocksdb::Status s = db->samples_db->Write(rocksdb::WriteOptions(), &batch);
+  kad_unlock_samples(lock);
+  if(!s.ok()) {
+    int status = kad_status(s);
+    return kad_error(status, "failed to store the totals of the sample");
+  }
+  db->samples[id].info = info;
+  return KAD_OK;
+}
+
+int get_sample_totals(kad_db_t* db, uint16_t id, sample_totals_t* totals) {
+  if(id >= db->samples.size() || db->samples[id].info.status != KAD_SAMPLE_COMPLETE)
+    return 0;
+  totals->nb_kmers = db->samples[id].info.nb_kmers;
+  totals->total_count = db->samples[id].info.total_count;
+  return 1;
+}
+
+/* Returns 0 if the sample has no count histogram */
+int get_sample_hist(kad_db_t* db, uint16_t id, sample_hist_t* hist) {
+  string value;
+  if(id >= db->samples.size()
+      || !db->samples_db->Get(rocksdb::ReadOptions(), sample_hist_key(id), &value).ok()
+      || value.size() != sizeof(sample_hist_t))
+    return 0;
+  memcpy(hist, value.data(), sizeof(sample_hist_t));
+  return 1;
+}
+
+void kad_stats_init(kad_stats_t* stats) {
+  stats->support.assign(2, 0);
+  stats->count_hist.assign(KAD_COUNT_BUCKETS, 0);
+}
+
+void kad_stats_merge(kad_stats_t* stats, const kad_stats_t* other) {
+  if(other->support.size() > stats->support.size())
+    stats->support.resize(other->support.size(), 0);
+  for (size_t i = 0; i < other->support.size(); i++)
+    stats->support[i] += other->support[i];
+  for (size_t i = 0; i < KAD_COUNT_BUCKETS; i++)
+    stats->count_hist[i] += other->count_hist[i];
+}
+
+/* Load the histograms stored in samples_db, returns 0 if there are none */
+int kad_load_stats(kad_db_t* db, kad_stats_t* stats) {
+  string support, count_hist;
+  kad_stats_init(stats);
+  if(!db->samples_db->Get(rocksdb::ReadOptions(), "_support_hist", &support).ok()
+      || !db->samples_db->Get(rocksdb::ReadOptions(), "_count_hist", &count_hist).ok()
+      || count_hist.size() != KAD_COUNT_BUCKETS * sizeof(int64_t))
+    return 0;
+  stats->support.resize(support.size() / sizeof(int64_t));
+  memcpy(stats->support.data(), support.data(), stats->support.size() * sizeof(int64_t));
+  memcpy(stats->count_hist.data(), count_hist.data(), KAD_COUNT_BUCKETS * sizeof(int64_t));
+  return 1;
+}
+
+/* Add the changes made by an indexing run to the stored histograms, in a
+ * batch of samples_db */
+void kad_stats_batch(kad_db_t* db, const kad_stats_t* delta, rocksdb::WriteBatch* batch) {
+  kad_stats_t stats;
+  kad_load_stats(db, &stats);
+  kad_stats_merge(&stats, delta);
+  batch->Put("_support_hist", rocksdb::Slice((char*)stats.support.data(), stats.support.size() * sizeof(int64_t)));
+  batch->Put("_count_hist", rocksdb::Slice((char*)stats.count_hist.data(), KAD_COUNT_BUCKETS * sizeof(int64_t)));
+}
+
+int kad_save_stats(kad_db_t* db, const kad_stats_t* delta) {
+  rocksdb::WriteBatch batch;
+  kad_stats_batch(db, delta, &batch);
+  rocksdb::Status s = db->samples_db->Write(rocksdb::WriteOptions(), &batch);
+  if(!s.ok()) {
+    int status = kad_status(s);
+    return kad_error(status, "failed to update the histograms of the database");
+  }
+  return KAD_OK;
+}
+
+/* The histograms can only be maintained from an empty database, or if they
+ * already exist */
+int kad_has_stats(kad_db_t* db, uint16_t first_sample_id) {
+  string value;
+  return first_sample_id == 0 || db->samples_db->Get(rocksdb::ReadOptions(), "_count_hist", &value).ok();
+}
+
+/* Sample-major layout: in the KAD_SAMPLE_MAJOR column family of counts_db,
+ * the k-mers of every sample are stored in sorted blocks of at most
+ * KAD_SAMPLE_BLOCK k-mers. The key of a block is the sample id followed by
+ * its first k-mer, both big-endian so that the blocks of a sample are
+ * contiguous and in k-mer order. The value is the number of k-mers of the
+ * block and, for each k-mer, the varint of its difference with the previous
+ * k-mer followed by the varint of its count */
+string sample_major_key(uint16_t id, uint64_t kmer) {
+  string key(sizeof(uint16_t) + sizeof(uint64_t), 0);
+  key[0] = id >> 8;
+  key[1] = id & 0xFF;
+  for (int i = 0; i < 8; i++)
+    key[2 + i] = (kmer >> (56 - 8*i)) & 0xFF;
+  return key;
+}
+
+static inline void put_varint(string& out, uint64_t v) {
+  while(v >= 0x80) {
+    out += (char)(v | 0x80);
+    v >>= 7;
+  }
+  out += (char)v;
+}
+
+static inline const char* get_varint(const char* p, uint64_t* v) {
+  uint64_t result = 0;
+  for (int shift = 0; ; shift += 7) {
+    uint8_t byte = *p++;
+    result |= (uint64_t)(byte & 0x7F) << shift;
+    if(!(byte & 0x80))
+      break;
+  }
+  *v = result;
+  return p;
+}
+
+/* Put one block of the sample id in batch */
+static void sample_major_put_block(kad_db_t* db, uint16_t id, const vector< pair<uint64_t, uint16_t> >& kmers,
+    string& block, rocksdb::WriteBatch* batch) {
+  block.clear();
+  put_varint(block, kmers.size());
+  uint64_t previous = kmers[0].first;
+  for (size_t i = 0; i < kmers.size(); i++) {
+    put_varint(block, kmers[i].first - previous);
+    put_varint(block, kmers[i].second);
+    previous = kmers[i].first;
+  }
+  batch->Put(db->sample_major, sample_major_key(id, kmers[0].first), block);
+}
+
+/* A sorted run of the k-mers of a sample: a run file of kad_ingest_spill(),
+ * or the k-mers left in memory when fp is NULL */
+typedef struct {
+  FILE* fp;
+  const pair<uint64_t, uint16_t>* next;
+  const pair<uint64_t, uint16_t>* end;
+  uint64_t kmer;
+  uint16_t count;
+} sample_run_t;
+
+static int sample_run_next(sample_run_t* run) {
+  if(!run->fp) {
+    if(run->next == run->end)
+      return 0;
+    run->kmer = run->next->first;
+    run->count = run->next->second;
+    run->next++;
+    return 1;
+  }
+  return fread(&run->kmer, sizeof(uint64_t), 1, run->fp) == 1
+    && fread(&run->count, sizeof(uint16_t), 1, run->fp) == 1;
+}
+
+/* Write the k-mers of a sample in the sample-major layout: the sorted runs
+ * spilled to files during the ingest are merged with the k-mers still in
+ * memory, which are sorted first, the input files do not have to be */
+int kad_put_sample_major(kad_db_t* db, uint16_t id, const vector<string>& runs,
+    vector< pair<uint64_t, uint16_t> >& kmers, const rocksdb::WriteOptions& write_options) {
+  if(!db->sample_major) {
+    rocksdb::Status s = db->counts_db->CreateColumnFamily(rocksdb::ColumnFamilyOptions(),
+        KAD_SAMPLE_MAJOR, &db->sample_major);
+    if(!s.ok()) {
+      int status = kad_status(s);
+      return kad_error(status, "Failed to create the sample-major column family: " + s.ToString());
+    }
+  }
+  if(!is_sorted(kmers.begin(), kmers.end()))
+    sort(kmers.begin(), kmers.end());
+
+  vector<sample_run_t> sources(runs.size() + 1);
+  int status = KAD_OK;
+  for (size_t i = 0; i < runs.size(); i++) {
+    sources[i].fp = fopen(runs[i].c_str(), "rb");
+    if(!sources[i].fp)
+      status = kad_error(KAD_IO_ERROR, "Failed to open the run file " + runs[i]);
+  }
+  sources[runs.size()].fp = NULL;
+  sources[runs.size()].next = kmers.data();
+  sources[runs.size()].end = kmers.data() + kmers.size();
+
+  // Min-heap of the next k-mer of every run
+  typedef pair<uint64_t, size_t> head_t;
+  priority_queue< head_t, vector<head_t>, greater<head_t> > heads;
+  for (size_t i = 0; status == KAD_OK && i < sources.size(); i++) {
+    if(sample_run_next(&sources[i]))
+      heads.push(head_t(sources[i].kmer, i));
+  }
+
+  rocksdb::WriteBatch batch;
+  vector< pair<uint64_t, uint16_t> > block_kmers;
+  string block;
+  while(status == KAD_OK && !heads.empty()) {
+    sample_run_t* run = &sources[heads.top().second];
+    size_t i = heads.top().second;
+    heads.pop();
+    block_kmers.push_back(make_pair(run->kmer, run->count));
+    if(sample_run_next(run))
+      heads.push(head_t(run->kmer, i));
+    if(block_kmers.size() == KAD_SAMPLE_BLOCK || heads.empty()) {
+      sample_major_put_block(db, id, block_kmers, block, &batch);
+      block_kmers.clear();
+    }
+    if(batch.GetDataSize() >= kad_ingest_bytes(db, KAD_BATCH_BYTES) || heads.empty()) {
+      status = kad_status(db->counts_db->Write(write_options, &batch));
+      batch.Clear();
+    }
+  }
+  for (size_t i = 0; i < runs.size(); i++) {
+    if(sources[i].fp && ferror(sources[i].fp) && status == KAD_OK)
+      status = kad_error(KAD_IO_ERROR, "Failed to read the run file " + runs[i]);
+    if(sources[i].fp)
+      fclose(sources[i].fp);
+  }
+  return status;
+}
+
+void sample_stream_open(kad_db_t* db, uint16_t id, sample_stream_t* stream) {
+  string lower_bound = sample_major_key(id, 0);
+  // The prefix of the next sample id, or no bound after the last id
+  rocksdb::ReadOptions read_options;
+  read_options.fill_cache = false;
+  if(id < UINT16_MAX) {
+    stream->upper_bound = sample_major_key(id + 1, 0);
+    stream->upper_bound_slice = stream->upper_bound;
+    read_options.iterate_upper_bound = &stream->upper_bound_slice;
+  }
+  stream->it = db->counts_db->NewIterator(read_options, db->sample_major);
+  stream->it->Seek(lower_bound);
+  stream->nb_left = 0;
+  stream->started = 0;
+}
+
+/* Read the next k-mer of the stream in kmer and count, returns 0 at the end
+ * and a negative KAD_STATUS on error */
+int sample_stream_next(sample_stream_t* stream) {
+  if(stream->nb_left == 0) {
+    // The current block is read from the value of the iterator, so it only
+    // moves to the next block once the current one is done
+    if(stream->started && stream->it->Valid())
+      stream->it->Next();
+    stream->started = 1;
+    if(!stream->it->Valid())
+      return kad_status(stream->it->status());
+    rocksdb::Slice key = stream->it->key();
+    stream->kmer = 0;
+    for (int i = 0; i < 8; i++)
+      stream->kmer = (stream->kmer << 8) | (uint8_t)key.data()[2 + i];
+    stream->p = get_varint(stream->it->value().data(), &stream->nb_left);
+  }
+  uint64_t delta, count;
+  stream->p = get_varint(stream->p, &delta);
+  stream->p = get_varint(stream->p, &count);
+  stream->kmer += delta;
+  stream->count = count;
+  stream->nb_left--;
+  return 1;
+}
+
+void sample_stream_close(sample_stream_t* stream) {
+  delete stream->it;
+}
+
+/* The progress marker of a sample, it only exists until the sample is
+ * complete */
+string sample_progress_key(uint16_t id) {
+  string key((char*)&id, sizeof(uint16_t));
+  key += "progress";
+  return key;
+}
+
+int kad_sample_progress(kad_db_t* db, uint16_t id, kad_progress_t* progress) {
+  if(id >= db->samples.size() || db->samples[id].info.status != KAD_SAMPLE_INDEXING)
+    return 0;
+  string value;
+  rocksdb::Status s = db->samples_db->Get(rocksdb::ReadOptions(), sample_progress_key(id), &value);
+  if(!s.ok() || value.size() != sizeof(kad_progress_t))
+    return 0;
+  memcpy(progress, value.data(), sizeof(kad_progress_t));
+  return 1;
+}
+
+/* Ingest session: the counts of the sample are appended to the count list
+ * of every k-mer, and written in batches of kad_ingest_bytes() */
+struct kad_ingest_s {
+  kad_db_t* db;
+  uint16_t sample_id;
+  int flags;
+  rocksdb::WriteOptions write_options;
+  rocksdb::WriteBatch batch;
+  size_t batch_bytes;
+  size_t nb_batches;    // written since the last progress marker
+  int resumed;          // the k-mers after the marker may already have a count
+  uint64_t last_kmer;
+  sample_totals_t totals;
+  kad_stats_t stats;    // since the last progress marker
+  int update_stats;
+  sample_hist_t hist;   // of the whole sample, saved with the markers
+  int keep_hist;        // 0 when resuming a sample without a saved histogram
+  vector< pair<uint64_t, uint16_t> > sample_kmers; // KAD_INGEST_SAMPLE_MAJOR
+  vector<string> sample_runs; // run files of the sample_kmers spilled by kad_ingest_spill()
+  size_t run_bytes;
+  string value;
+  vector<count_t> counts;
+};
+
+static kad_ingest_t* kad_ingest_new(kad_db_t* db, uint16_t sample_id, int flags) {
+  kad_ingest_t* s = new kad_ingest_t();
+  s->db = db;
+  s->sample_id = sample_id;
+  s->flags = flags;
+  s->write_options.disableWAL = (flags & KAD_INGEST_NO_WAL) != 0;
+  s->batch_bytes = kad_ingest_bytes(db, KAD_BATCH_BYTES);
+  s->run_bytes = kad_ingest_bytes(db, KAD_SAMPLE_RUN_BYTES);
+  s->nb_batches = 0;
+  s->resumed = 0;
+  s->last_kmer = 0;
+  s->totals = { 0, 0 };
+  kad_stats_init(&s->stats);
+  s->update_stats = kad_has_stats(db, sample_id);
+  memset(&s->hist, 0, sizeof(sample_hist_t));
+  s->keep_hist = 1;
+  return s;
+}
+
+/* Free a session and its run files */
+static void kad_ingest_free(kad_ingest_t* s) {
+  for (size_t i = 0; i < s->sample_runs.size(); i++)
+    remove(s->sample_runs[i].c_str());
+  delete s;
+}
+
+/* Sort the k-mers of a sample-major session and write them to a run file
+ * next to counts_db, so that the session keeps at most run_bytes of k-mers
+ * in memory. The runs are merged into blocks by the commit */
+static int kad_ingest_spill(kad_ingest_t* s) {
+  sort(s->sample_kmers.begin(), s->sample_kmers.end());
+  string path = s->db->counts_db->GetName() + "_sample_major_" + to_string(s->sample_id) + "_"
+    + to_string(getpid()) + "_" + to_string(s->sample_runs.size()) + ".run";
+  FILE* fp = fopen(path.c_str(), "wb");
+  if(!fp)
+    return kad_error(KAD_IO_ERROR, "Failed to create the run file " + path);
+  s->sample_runs.push_back(path);
+  for (size_t i = 0; i < s->sample_kmers.size(); i++) {
+    fwrite(&s->sample_kmers[i].first, sizeof(uint64_t), 1, fp);
+    fwrite(&s->sample_kmers[i].second, sizeof(uint16_t), 1, fp);
+  }
+  int failed = ferror(fp);
+  if(fclose(fp) != 0 || failed)
+    return kad_error(KAD_IO_ERROR, "Failed to write the run file " + path);
+  s->sample_kmers.clear();
+  return KAD_OK;
+}
+
+/* Write the pending batch and the marker, along with the histograms of the
+ * counts written since the last one so that they are updated atomically.
+ * The histogram of the sample matches the marker, and is reloaded by a
+ * resume */
+static int kad_ingest_write_progress(kad_ingest_t* s, uint64_t offset) {
+  rocksdb::Status st;
+  if(s->batch.Count() > 0) {
+    st = s->db->counts_db->Write(s->write_options, &s->batch);
+    if(!st.ok())
+      return kad_status(st);
+    s->batch.Clear();
+  }
+  // Without WAL the counts are only durable once flushed
+  if(s->write_options.disableWAL && !(st = s->db->counts_db->Flush(rocksdb::FlushOptions())).ok())
+    return kad_status(st);
+
+  kad_progress_t progress = { offset, s->last_kmer, s->totals.nb_kmers, s->totals.total_count };
+  rocksdb::WriteBatch batch;
+  batch.Put(sample_progress_key(s->sample_id), rocksdb::Slice((char*)&progress, sizeof(progress)));
+  if(s->keep_hist)
+    batch.Put(sample_hist_key(s->sample_id), rocksdb::Slice((char*)&s->hist, sizeof(sample_hist_t)));
+  if(s->update_stats) {
+    kad_stats_batch(s->db, &s->stats, &batch);
+    kad_stats_init(&s->stats);
+  }
+  st = s->db->samples_db->Write(rocksdb::WriteOptions(), &batch);
+  if(!st.ok())
+    return kad_error(kad_status(st), "failed to write the progress marker of the sample");
+  s->nb_batches = 0;
+  return KAD_OK;
+}
+
+int kad_ingest_begin(kad_db_t* db, const char* sample_name, int flags, kad_ingest_t** session) {
+  *session = NULL;
+  if(db->mode != KAD_READ_WRITE || db->mem)
+    return kad_error(KAD_NOT_SUPPORTED, "The database is not opened for writing");
+  uint16_t sample_id;
+  int status = add_sample(db, sample_name, &sample_id);
+  if(status != KAD_OK)
+    return status;
+
+  // The first marker flags the sample as incomplete until the commit
+  kad_ingest_t* s = kad_ingest_new(db, sample_id, flags);
+  status = kad_ingest_write_progress(s, 0);
+  if(status != KAD_OK) {
+    kad_ingest_free(s);
+    return status;
+  }
+  *session = s;
+  return KAD_OK;
+}
+
+int kad_ingest_resume(kad_db_t* db, const char* sample_name, int flags, kad_ingest_t** session,
+    kad_progress_t* progress) {
+  *session = NULL;
+  if(db->mode != KAD_READ_WRITE || db->mem)
+    return kad_error(KAD_NOT_SUPPORTED, "The database is not opened for writing");
+  if(flags & KAD_INGEST_SAMPLE_MAJOR)
+    return kad_error(KAD_NOT_SUPPORTED, "The indexing of a sample-major sample cannot be resumed");
+
+  // The last sample with this name, there may be several
+  int found = 0;
+  uint16_t sample_id = 0;
+  for (size_t id = db->samples.size(); id-- > 0 && !found;) {
+    if(db->samples[id].name == sample_name) {
+      sample_id = id;
+      found = 1;
+    }
+  }
+  if(!found)
+    return kad_error(KAD_NOT_FOUND, string("No sample ") + sample_name + " in the database");
+  if(!kad_sample_progress(db, sample_id, progress))
+    return kad_error(KAD_INVALID_ARGUMENT, string("The sample ") + sample_name + " is already complete");
+
+  kad_ingest_t* s = kad_ingest_new(db, sample_id, flags);
+  s->resumed = 1;
+  s->last_kmer = progress->last_kmer;
+  s->totals = { progress->nb_kmers, progress->total_count };
+  s->keep_hist = get_sample_hist(db, sample_id, &s->hist);
+  *session = s;
+  return KAD_OK;
+}
+
+int kad_ingest_checkpoint(kad_ingest_t* s, uint64_t offset, int batches) {
+  if(s->nb_batches < (size_t)batches || (s->flags & KAD_INGEST_SAMPLE_MAJOR))
+    return 0;
+  int status = kad_ingest_write_progress(s, offset);
+  return status == KAD_OK ? 1 : status;
+}
+
+int kad_ingest_add(kad_ingest_t* s, uint64_t kmer, uint32_t count_int) {
+  // Absent from the sample, like the zero cells of a matrix
+  if(count_int == 0)
+    return KAD_OK;
+  uint16_t count = count_int > UINT16_MAX ? UINT16_MAX : count_int;
+  s->totals.nb_kmers++;
+  s->totals.total_count += count_int;
+  s->last_kmer = kmer;
+  if(s->flags & KAD_INGEST_SAMPLE_MAJOR) {
+    s->sample_kmers.push_back(make_pair(kmer, count));
+    if(s->sample_kmers.size() * sizeof(s->sample_kmers[0]) >= s->run_bytes) {
+      int status = kad_ingest_spill(s);
+      if(status != KAD_OK)
+        return status;
+    }
+  }
+
+  char buf[KAD_KEY_MAX_BYTES];
+  rocksdb::Slice key = kad_key(s->db, kmer, buf);
+  rocksdb::Status st = s->db->counts_db->Get(rocksdb::ReadOptions(), key, &s->value);
+
+  // The k-mer is already in the database
+  s->counts.clear();
+  if(st.ok()) {
+    const count_t* old = (const count_t*)s->value.data();
+    s->counts.assign(old, old + s->value.size() / sizeof(count_t));
+  } else if(!st.IsNotFound()) {
+    return kad_status(st);
+  }
+  if(s->resumed) {
+    // Samples indexed since the interruption come after this one, and the
+    // count written after the last marker by the interrupted session is
+    // dropped, wherever it is
+    vector<count_t>::iterator pos = s->counts.begin();
+    while(pos != s->counts.end() && pos->id < s->sample_id)
+      pos++;
+    if(pos != s->counts.end() && pos->id == s->sample_id)
+      pos = s->counts.erase(pos);
+    s->counts.insert(pos, { s->sample_id, count });
+  } else {
+    s->counts.push_back({ s->sample_id, count });
+  }
+
+  if(s->db->sketch)
+    kad_sketch_add(s->db->sketch, kmer, count);
+  kad_stats_move(&s->stats, s->counts.size() - 1, s->counts.size());
+  s->stats.count_hist[count_bucket(count)]++;
+  s->hist.count_hist[count_bucket(count)]++;
+
+  s->batch.Put(key, rocksdb::Slice((char*)s->counts.data(), s->counts.size() * sizeof(count_t)));
+  if(s->batch.GetDataSize() >= s->batch_bytes) {
+    st = s->db->counts_db->Write(s->write_options, &s->batch);
+    if(!st.ok())
+      return kad_status(st);
+    s->batch.Clear();
+    s->nb_batches++;
+  }
+  return KAD_OK;
+}
+
+int kad_ingest_commit(kad_ingest_t* s) {
+  int status = KAD_OK;
+  if(s->batch.Count() > 0)
+    status = kad_status(s->db->counts_db->Write(s->write_options, &s->batch));
+  if(status == KAD_OK && (s->flags & KAD_INGEST_SAMPLE_MAJOR))
+    status = kad_put_sample_major(s->db, s->sample_id, s->sample_runs, s->sample_kmers, s->write_options);
+  // Totals, histograms and the removal of the marker complete the sample,
+  // and the sketch is saved under the same lock to cover it in a copy
+  if(status == KAD_OK) {
+    rocksdb::WriteBatch batch;
+    kad_sample_info_t info = kad_complete_sample(s->db, s->sample_id, &s->totals,
+        s->keep_hist ? &s->hist : NULL, &batch);
+    if(s->update_stats)
+      kad_stats_batch(s->db, &s->stats, &batch);
+    batch.Delete(sample_progress_key(s->sample_id));
+    int lock = kad_lock_samples(s->db);
+    status = kad_status(s->db->samples_db->Write(rocksdb::WriteOptions(), &batch));
+    if(status == KAD_OK)
+      s->db->samples[s->sample_id].info = info;
+    else
+      kad_error(status, "failed to complete the sample");
+    if(status == KAD_OK && s->db->sketch)
+      status = kad_sketch_save(s->db);
+    kad_unlock_samples(lock);
+  }
+  kad_ingest_free(s);
+  return status;
+}
+
+void kad_ingest_abort(kad_ingest_t* s) {
+  kad_ingest_free(s);
+}
@@ -0,0 +1,166 @@
+/* libkad: the KAD k-mer count database as a C++ library.
+ *
+ * A database is opened with kad_open() and closed with kad_destroy(). The
+ * functions return KAD_OK or a negative KAD_STATUS, the message of the last
+ * error of the calling thread is returned by kad_last_error(). A handle can
+ * be shared by several threads for the lookups and iterators, an ingest
+ * session must be used by a single thread. */
+#ifndef LIBKAD_H
+#define LIBKAD_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KAD_VERSION "0.0.4"
+#define KMER_LENGTH 32
+
+/* Count of a k-mer in the sample id */
+typedef struct {
+  uint16_t id;
+  uint16_t n;
+} count_t;
+
+typedef struct kad_db_s kad_db_t;
+typedef struct kad_iterator_s kad_iterator_t;
+typedef struct kad_ingest_s kad_ingest_t;
+
+enum KAD_STATUS {
+  KAD_OK = 0,
+  KAD_NOT_FOUND = -1,
+  KAD_IO_ERROR = -2,
+  KAD_CORRUPTION = -3,
+  KAD_INVALID_ARGUMENT = -4,
+  KAD_NOT_SUPPORTED = -5,
+  KAD_BUFFER_TOO_SMALL = -6,
+  KAD_ERROR = -7
+};
+
+enum KAD_OPEN_MODE { KAD_READ_WRITE, KAD_READ_ONLY, KAD_SECONDARY };
+
+/* How the batch lookups read the counts database. By default MultiGet
+ * reads the blocks of a batch asynchronously (with io_uring when RocksDB
+ * supports it, and synchronous reads otherwise) */
+enum KAD_IO_FLAGS {
+  KAD_SYNC_IO = 1,       // one block read at a time
+  KAD_DIRECT_READS = 2,  // bypass the page cache of the OS
+  KAD_NO_FILL_CACHE = 4  // do not keep the blocks read in the block cache
+};
+
+/* Order of the keys of the counts database. KAD_LAYOUT_MINIMIZER prefixes
+ * every k-mer with its minimizer, so that the overlapping k-mers of a
+ * sequence, which mostly share their minimizer, are stored together */
+enum KAD_KEY_LAYOUT { KAD_LAYOUT_KMER, KAD_LAYOUT_MINIMIZER };
+
+/* Flags of an ingest session */
+enum KAD_INGEST_FLAGS {
+  KAD_INGEST_NO_WAL = 1,       // do not write the WAL (see kad index --bulk)
+  KAD_INGEST_SAMPLE_MAJOR = 2  // also write the sample-major layout
+};
+
+const char* kad_last_error();
+
+/* 2-bit encoding of the KMER_LENGTH bases of str, first base in the high
+ * bits. kad_kmer_to_str() writes the KMER_LENGTH bases of kmer and a null
+ * character in str */
+uint64_t kad_str_to_kmer(const char* str);
+void kad_kmer_to_str(uint64_t kmer, char* str);
+
+/* Open the database of the directory db_path in *db. Only the
+ * KAD_READ_WRITE mode creates the database and takes the RocksDB lock; the
+ * KAD_READ_ONLY and KAD_SECONDARY modes can be used by any number of readers
+ * while an indexer is running. A secondary instance keeps its own files in
+ * secondary_path and follows the writes of the primary with kad_catch_up().
+ * io_flags are KAD_IO_FLAGS, and memory is the memory budget in bytes (0 for
+ * the RocksDB defaults) */
+int kad_open(const char* db_path, int mode, const char* secondary_path, int io_flags, size_t memory,
+    kad_db_t** db);
+/* Create an empty database with a KAD_KEY_LAYOUT, kad_open() creates it with
+ * KAD_LAYOUT_KMER */
+int kad_create(const char* db_path, int layout);
+void kad_destroy(kad_db_t* db);
+int kad_catch_up(kad_db_t* db);
+
+/* Copy the counts in memory, the next reads do not go through RocksDB */
+int kad_mem_load(kad_db_t* db);
+
+enum KAD_SAMPLE_STATUS {
+  KAD_SAMPLE_INDEXING = 1, // being indexed, or interrupted (see kad_sample_progress())
+  KAD_SAMPLE_COMPLETE = 2,
+  KAD_SAMPLE_NO_TOTALS = 3 // indexed by a kad that did not keep the totals
+};
+
+/* Record of a sample, as stored in the database */
+typedef struct {
+  uint32_t status;      // KAD_SAMPLE_STATUS
+  uint32_t reserved;
+  int64_t ctime;        // creation time in seconds since the epoch, 0 if unknown
+  uint64_t nb_kmers;    // distinct k-mers, once complete
+  uint64_t total_count; // sum of the counts, once complete
+} kad_sample_info_t;
+
+/* The samples have the ids 0 to kad_nb_samples() - 1. Their names and
+ * records are read from memory, kad_catch_up() reloads them */
+uint32_t kad_nb_samples(kad_db_t* db);
+/* Copy the name of the sample id, null-terminated, in the size bytes of
+ * name. KAD_NOT_FOUND if there is none, KAD_BUFFER_TOO_SMALL if it does not
+ * fit */
+int kad_sample_name(kad_db_t* db, uint16_t id, char* name, size_t size);
+/* Record of the sample id, KAD_NOT_FOUND if there is none */
+int kad_sample_info(kad_db_t* db, uint16_t id, kad_sample_info_t* info);
+
+/* Look up n keys sorted in increasing order. The counts of keys[i] are
+ * written in counts[offsets[i]..offsets[i+1]], offsets has n + 1 entries.
+ * Returns KAD_BUFFER_TOO_SMALL if the counts do not fit in capacity, with
+ * the capacity needed in offsets[n] */
+int kad_lookup(kad_db_t* db, size_t n, const uint64_t* keys, count_t* counts, size_t capacity,
+    size_t* offsets);
+
+/* Upper bound of the count of each key in any sample, from the sketch of
+ * the database and without reading the counts. A bound of 0 means the key
+ * is absent. Returns KAD_NOT_SUPPORTED if the database has no sketch */
+int kad_approx(kad_db_t* db, size_t n, const uint64_t* keys, uint16_t* bounds);
+
+/* Iterate over the k-mers from first to last (included) in increasing
+ * order. kad_iterator_next() returns 1 and points counts to the counts of
+ * the next k-mer, without any copy, until the next call; 0 at the end. With
+ * KAD_LAYOUT_MINIMIZER the k-mers come in the order of the keys, and first
+ * and last are positions in this order (see kad_key_position()) */
+uint64_t kad_key_position(kad_db_t* db, uint64_t kmer);
+int kad_iterator_new(kad_db_t* db, uint64_t first, uint64_t last, kad_iterator_t** it);
+int kad_iterator_next(kad_iterator_t* it, uint64_t* kmer, const count_t** counts, size_t* nb_counts);
+void kad_iterator_destroy(kad_iterator_t* it);
+
+/* Progress marker of a sample being indexed */
+typedef struct {
+  uint64_t offset;      // position in the input of the next record to add
+  uint64_t last_kmer;   // last k-mer added before the marker
+  uint64_t nb_kmers;    // k-mers added before the marker
+  uint64_t total_count; // sum of their counts
+} kad_progress_t;
+
+/* Index the counts of a new sample. The counts are written in batches as
+ * they are added, and kad_ingest_commit() writes the last batch and the
+ * totals of the sample, which is only then complete. An aborted session
+ * leaves the sample partially indexed, with the last progress marker
+ * written by kad_ingest_checkpoint(), and kad_ingest_resume() continues it
+ * from there. Commit and abort free the session. The zero counts are
+ * skipped, and the counts above UINT16_MAX are saturated in the database
+ * but added unchanged to the totals of the sample */
+int kad_ingest_begin(kad_db_t* db, const char* sample_name, int flags, kad_ingest_t** session);
+int kad_ingest_resume(kad_db_t* db, const char* sample_name, int flags, kad_ingest_t** session,
+    kad_progress_t* progress);
+int kad_ingest_add(kad_ingest_t* session, uint64_t kmer, uint32_t count);
+/* Write a progress marker once every batches batches have been written
+ * since the last one, so it can be called after every record. offset is
+ * the position in the input after the last record added. Returns 1 if a
+ * marker was written. Sessions with KAD_INGEST_SAMPLE_MAJOR spill the
+ * k-mers of the sample to sorted run files next to the database, merged
+ * into blocks by the commit: they cannot be resumed and write no marker */
+int kad_ingest_checkpoint(kad_ingest_t* session, uint64_t offset, int batches);
+int kad_ingest_commit(kad_ingest_t* session);
+void kad_ingest_abort(kad_ingest_t* session);
+
+/* Returns 1 and the last progress marker if the sample id is not complete */
+int kad_sample_progress(kad_db_t* db, uint16_t id, kad_progress_t* progress);
+
+#endif
@@ -0,0 +1,401 @@
+/* Internals of libkad shared by the library and the kad command line tool.
+ * The tool works directly on the RocksDB databases of the handle for the
+ * commands that are not part of the public API (bulk loading, optimize,
+ * checkpoints...) */
+#ifndef LIBKAD_INTERNAL_H
+#define LIBKAD_INTERNAL_H
+
+#include <rocksdb/db.h>
+#include <rocksdb/slice.h>
+#include <rocksdb/write_batch.h>
+#include <rocksdb/comparator.h>
+#include <rocksdb/table.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/cache.h>
+#include <rocksdb/write_buffer_manager.h>
+#include <ctime>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <utility>
+
+#include "libkad.h"
+
+#define KAD_CATCH_UP_INTERVAL 10 // seconds
+#define KAD_COUNT_BUCKETS 17 // log2 buckets of a uint16_t count
+#define KAD_SAMPLE_MAJOR "sample_major" // column family of the sample-major layout
+#define KAD_SAMPLE_BLOCK 1024 // k-mers per block of the sample-major layout
+#define KAD_SAMPLE_RUN_BYTES (256 << 20) // k-mers of a sample-major session kept in memory
+#define KAD_BATCH_BYTES (4 << 20) // size of the write batches of kad index
+#define KAD_MIN_WRITE_BUFFER (1 << 20) // smallest memtable of a memory budget
+#define KAD_CHECKPOINT_BATCHES 16 // write batches between two progress markers
+#define KAD_SKETCH_FILE "sketch" // file of the sketch in the database directory
+#define KAD_SAMPLES_LOCK_FILE "samples.lock" // see kad_lock_samples()
+#define KAD_SKETCH_MAGIC "KADSKT1"
+#define KAD_SKETCH_ROWS 4
+#define KAD_SKETCH_WIDTH 8 // counters of a row in a block
+#define KAD_MINIMIZER_LENGTH 12
+#define KAD_KEY_MAX_BYTES 11 // 3 bytes of minimizer and the k-mer
+
+enum DNA_MAP {A, C, G, T};  // A=1, C=0, T=2, G=3
+
+typedef struct kad_backend_s kad_backend_t;
+
+/* In-memory copy of the counts database (kad --in-memory). The keys are
+ * kept in one sorted array, with an index of the first key of every value
+ * of their top bits to start the search close to the key. The count lists
+ * of all the keys are stored one after the other in a single arena */
+typedef struct {
+  std::vector<uint64_t> keys;
+  std::vector<uint64_t> offsets; // counts of keys[i] are arena[offsets[i]..offsets[i+1]]
+  std::vector<count_t> arena;
+  std::vector<uint64_t> buckets; // first key of each value of the top bucket_bits
+  int bucket_bits;
+} kad_mem_t;
+
+/* Memory budget of kad --memory, shared by the two databases. The block
+ * cache has the budget minus the ingest buffers, and the memtables of both
+ * databases are charged to it through the write buffer manager */
+typedef struct {
+  size_t total;
+  size_t block_cache;   // capacity of the cache, memtables included
+  size_t write_buffers; // memtables of both databases
+  size_t ingest;        // write batches and bulk runs
+  std::shared_ptr<rocksdb::Cache> cache;
+  std::shared_ptr<rocksdb::WriteBufferManager> write_buffer_manager;
+} kad_memory_t;
+
+/* Blocked count-min sketch of the highest count of every k-mer over the
+ * samples. A k-mer is hashed to one block of a cache line, which has one
+ * group of KAD_SKETCH_WIDTH counters per row. Each counter keeps the max
+ * of the counts added to it, so the min over the rows is an upper bound of
+ * the count of the k-mer in any sample, and 0 means the k-mer is absent */
+typedef struct {
+  uint64_t nb_blocks;
+  uint32_t nb_samples; // samples covered by the sketch
+  std::vector<uint16_t> cells; // nb_blocks * KAD_SKETCH_ROWS * KAD_SKETCH_WIDTH
+} kad_sketch_t;
+
+/* Header of the database, stored in samples_db under "_header". The
+ * databases written before it have none, they are format 1 and upgraded
+ * when they are opened for writing */
+#define KAD_HEADER_MAGIC "KADDB"
+#define KAD_FORMAT_VERSION 2
+#define KAD_VALUE_FORMAT 1 // lists of count_t sorted by sample id
+typedef struct {
+  char magic[8];           // KAD_HEADER_MAGIC
+  uint32_t format_version; // KAD_FORMAT_VERSION of the kad that wrote it
+  uint32_t k;              // length of the k-mers
+  uint32_t canonical;      // 1 if the k-mers are canonical
+  uint32_t value_format;   // KAD_VALUE_FORMAT of counts_db
+  uint32_t key_layout;     // KAD_KEY_LAYOUT of counts_db
+  uint32_t reserved;
+} kad_header_t;
+
+/* A sample of the cache of samples_db. Its name is stored under the id,
+ * and its record under the key id + "record" */
+typedef struct {
+  std::string name;
+  kad_sample_info_t info;
+} kad_sample_t;
+
+struct kad_db_s {
+  kad_header_t header;
+  std::vector<kad_sample_t> samples; // by id, loaded at open
+  rocksdb::DB* samples_db;
+  rocksdb::DB* counts_db;
+  rocksdb::ColumnFamilyHandle* sample_major; // NULL until a sample is indexed with --sample-major
+  const kad_backend_t* backend; // reads of the counts, from counts_db or from mem
+  kad_mem_t* mem; // counts read from memory instead of counts_db when set
+  kad_memory_t* memory; // NULL for the RocksDB defaults
+  kad_sketch_t* sketch; // NULL if there is none, or if it does not cover every sample
+  int layout; // KAD_KEY_LAYOUT of counts_db
+  char* path;
+  int mode;
+  int io_flags;
+  time_t last_catch_up;
+};
+
+/* Settings of the counts database chosen by "kad optimize", stored in
+ * samples_db under "_counts_options" and applied at every open */
+typedef struct {
+  uint32_t bloom_bits;  // bits per key of the bloom filters, 0 for none
+  uint32_t compression; // rocksdb::CompressionType of the bottommost level
+  uint32_t dict_bytes;  // size of the zstd dictionary, 0 for none
+  int32_t level;        // compression level
+} kad_counts_config_t;
+
+/* Counts of a batch of keys, looked up in the backend of the database */
+typedef struct {
+  std::vector<rocksdb::Slice> slices;
+  std::vector<rocksdb::PinnableSlice> pinned;
+  std::vector<rocksdb::Status> statuses;
+  std::vector<const count_t*> counts; // NULL when the key is not found
+  std::vector<uint32_t> nb_counts;
+  std::vector<uint32_t> positions; // keys sent to RocksDB, the others are absent from the sketch
+  std::vector<char> key_bytes; // KAD_KEY_MAX_BYTES per key
+} kad_batch_t;
+
+/* Iterator of a backend over the k-mers at a position from first to last
+ * (included), in the order of the keys of the backend. Each backend only
+ * uses its own fields */
+struct kad_iterator_s {
+  kad_db_t* db;
+  uint64_t first, last;
+  rocksdb::Iterator* it; // RocksDB backend
+  char end_buf[KAD_KEY_MAX_BYTES];
+  rocksdb::Slice end_slice;
+  int started;
+  size_t k; // next key of the memory backend
+};
+
+/* Reads of the counts of a database. db->backend is kad_rocksdb_backend,
+ * reading counts_db, until kad_mem_load() switches it to kad_mem_backend,
+ * reading the in-memory copy db->mem. The iterator functions implement
+ * kad_iterator_new(), kad_iterator_next() and kad_iterator_destroy() on an
+ * iterator whose db, first and last are set */
+struct kad_backend_s {
+  const char* name;
+  int (*multi_get)(kad_db_t* db, kad_batch_t* batch, size_t n, const uint64_t* keys);
+  uint64_t (*key_position)(kad_db_t* db, uint64_t kmer);
+  void (*iterator_init)(kad_iterator_t* it);
+  int (*iterator_next)(kad_iterator_t* it, uint64_t* kmer, const count_t** counts, size_t* nb_counts);
+  void (*iterator_free)(kad_iterator_t* it);
+};
+
+extern const kad_backend_t kad_rocksdb_backend;
+extern const kad_backend_t kad_mem_backend;
+
+/* Library size of a sample, kept in its record (format 1 stored it under
+ * the key id + "totals") */
+typedef struct {
+  uint64_t nb_kmers;    // distinct k-mers
+  uint64_t total_count; // sum of the counts
+} sample_totals_t;
+
+/* Count distribution of a sample: count_hist[b] is the number of its k-mers
+ * with a count in the log2 bucket b (see count_bucket()). It is stored under
+ * id + "hist" by the index commands, the samples indexed by an older kad
+ * have none */
+typedef struct {
+  int64_t count_hist[KAD_COUNT_BUCKETS];
+} sample_hist_t;
+
+/* Histograms of the database: support[k] is the number of k-mers with k
+ * sample counts, and count_hist[b] the number of counts in the log2 bucket
+ * b (see count_bucket()). They are kept up to date in samples_db by the
+ * index commands as long as they were created on an empty database, and
+ * computed with a full scan by "kad info --deep" */
+typedef struct {
+  std::vector<int64_t> support;
+  std::vector<int64_t> count_hist;
+} kad_stats_t;
+
+/* Sequential reader of the k-mers of one sample in the sample-major layout */
+typedef struct {
+  rocksdb::Iterator* it;
+  std::string upper_bound;
+  rocksdb::Slice upper_bound_slice;
+  const char* p;        // next k-mer of the current block
+  uint64_t nb_left;     // k-mers left in the current block
+  int started;
+  uint64_t kmer;
+  uint16_t count;
+} sample_stream_t;
+
+/* Convert a RocksDB status to a KAD_STATUS, and keep its message for
+ * kad_last_error() */
+int kad_status(const rocksdb::Status& s);
+/* Set the message of kad_last_error() and return status */
+int kad_error(int status, const std::string& message);
+
+int kad_load_counts_config(rocksdb::DB* samples_db, kad_counts_config_t* config);
+kad_memory_t* kad_memory_init(size_t total);
+void kad_memory_options(const kad_memory_t* memory, rocksdb::Options* options,
+    rocksdb::BlockBasedTableOptions* table_options);
+rocksdb::Options kad_counts_options(const kad_counts_config_t* config, const kad_memory_t* memory,
+    int layout);
+rocksdb::Status kad_open_db(const rocksdb::Options& options, const std::string& path,
+    const char* secondary_path, const char* name, int mode, rocksdb::DB** db,
+    rocksdb::ColumnFamilyHandle** sample_major);
+
+kad_sketch_t* kad_sketch_new(size_t bytes);
+int kad_sketch_load(kad_db_t* db);
+int kad_sketch_save(kad_db_t* db);
+
+int kad_multi_get(kad_db_t* db, kad_batch_t* batch, size_t n, const uint64_t* keys);
+size_t kad_ingest_bytes(kad_db_t* db, size_t default_bytes);
+
+int kad_lock_samples(kad_db_t* db);
+void kad_unlock_samples(int lock);
+
+void kad_header_init(kad_header_t* header, int layout);
+int kad_load_samples(kad_db_t* db);
+int add_sample(kad_db_t* db, const char* sample_name, uint16_t* id);
+int put_sample_totals(kad_db_t* db, uint16_t id, const sample_totals_t* totals, const sample_hist_t* hist);
+int get_sample_totals(kad_db_t* db, uint16_t id, sample_totals_t* totals);
+int get_sample_hist(kad_db_t* db, uint16_t id, sample_hist_t* hist);
+
+void kad_stats_init(kad_stats_t* stats);
+void kad_stats_merge(kad_stats_t* stats, const kad_stats_t* other);
+int kad_load_stats(kad_db_t* db, kad_stats_t* stats);
+int kad_save_stats(kad_db_t* db, const kad_stats_t* delta);
+void kad_stats_batch(kad_db_t* db, const kad_stats_t* delta, rocksdb::WriteBatch* batch);
+int kad_has_stats(kad_db_t* db, uint16_t first_sample_id);
+
+int kad_put_sample_major(kad_db_t* db, uint16_t id, const std::vector<std::string>& runs,
+    std::vector< std::pair<uint64_t, uint16_t> >& kmers, const rocksdb::WriteOptions& write_options);
+void sample_stream_open(kad_db_t* db, uint16_t id, sample_stream_t* stream);
+int sample_stream_next(sample_stream_t* stream);
+void sample_stream_close(sample_stream_t* stream);
+
+/* Index of the first key >= kmer */
+static inline size_t kad_mem_lower_bound(const kad_mem_t* mem, uint64_t kmer) {
+  uint64_t b = kmer >> (64 - mem->bucket_bits);
+  return std::lower_bound(mem->keys.begin() + mem->buckets[b], mem->keys.begin() + mem->buckets[b + 1], kmer)
+    - mem->keys.begin();
+}
+
+/* Minimizer of a k-mer: its m-mer of KAD_MINIMIZER_LENGTH bases with the
+ * smallest hash, so that the frequent m-mers such as poly-A do not get most
+ * of the k-mers */
+static inline uint32_t kad_minimizer(uint64_t kmer) {
+  const uint64_t mask = (1ULL << (2 * KAD_MINIMIZER_LENGTH)) - 1;
+  uint32_t best = 0;
+  uint64_t best_hash = UINT64_MAX;
+  for (int i = 0; i <= KMER_LENGTH - KAD_MINIMIZER_LENGTH; i++) {
+    uint64_t mmer = (kmer >> (2 * i)) & mask;
+    uint64_t h = (mmer + 1) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+    if(h < best_hash) {
+      best_hash = h;
+      best = mmer;
+    }
+  }
+  return best;
+}
+
+static inline void kad_put_big_endian(char* buf, uint64_t v, int nb_bytes) {
+  for (int i = 0; i < nb_bytes; i++)
+    buf[i] = (v >> (8 * (nb_bytes - 1 - i))) & 0xFF;
+}
+
+static inline uint64_t kad_get_big_endian(const char* buf, int nb_bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < nb_bytes; i++)
+    v = (v << 8) | (uint8_t)buf[i];
+  return v;
+}
+
+/* Key of kmer in counts_db, written in buf of KAD_KEY_MAX_BYTES. The
+ * default layout is the k-mer in the byte order of the machine, ordered by
+ * KmerKeyComparator. The minimizer layout is the minimizer followed by the
+ * k-mer, both big-endian and ordered bytewise, which also lets the block
+ * prefix compression of RocksDB share the leading bytes of the keys */
+static inline rocksdb::Slice kad_key(const kad_db_t* db, uint64_t kmer, char* buf) {
+  if(db->layout == KAD_LAYOUT_KMER) {
+    memcpy(buf, &kmer, sizeof(uint64_t));
+    return rocksdb::Slice(buf, sizeof(uint64_t));
+  }
+  kad_put_big_endian(buf, kad_minimizer(kmer), 3);
+  kad_put_big_endian(buf + 3, kmer, 8);
+  return rocksdb::Slice(buf, KAD_KEY_MAX_BYTES);
+}
+
+static inline uint64_t kad_key_kmer(const kad_db_t* db, const rocksdb::Slice& key) {
+  if(db->layout == KAD_LAYOUT_KMER)
+    return *(uint64_t*)key.data();
+  return kad_get_big_endian(key.data() + 3, 8);
+}
+
+/* Order of two keys of counts_db */
+static inline int kad_key_compare(const kad_db_t* db, const rocksdb::Slice& a, const rocksdb::Slice& b) {
+  if(db->layout == KAD_LAYOUT_KMER) {
+    uint64_t kmer_a = *(uint64_t*)a.data(), kmer_b = *(uint64_t*)b.data();
+    return kmer_a < kmer_b ? -1 : kmer_a > kmer_b;
+  }
+  return memcmp(a.data(), b.data(), KAD_KEY_MAX_BYTES);
+}
+
+/* The scans cut the keys in ranges of positions: a uint64_t that increases
+ * with the keys. It is the k-mer itself in the default layout, and the
+ * minimizer followed by the top 40 bits of the k-mer in the minimizer
+ * layout. kad_position_key() is the first key at a position */
+static inline rocksdb::Slice kad_position_key(const kad_db_t* db, uint64_t position, char* buf) {
+  if(db->layout == KAD_LAYOUT_KMER) {
+    memcpy(buf, &position, sizeof(uint64_t));
+    return rocksdb::Slice(buf, sizeof(uint64_t));
+  }
+  kad_put_big_endian(buf, position >> 40, 3);
+  kad_put_big_endian(buf + 3, position << 24, 8);
+  return rocksdb::Slice(buf, KAD_KEY_MAX_BYTES);
+}
+
+/* First counter of every row of the block of kmer */
+static inline uint16_t* kad_sketch_block(const kad_sketch_t* sketch, uint64_t kmer, size_t* cells) {
+  // splitmix64 finalizer: the high bits pick the block, the low bits the
+  // counter of every row
+  uint64_t h = kmer + 0x9E3779B97F4A7C15ULL;
+  h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+  h ^= h >> 31;
+  uint64_t block = (uint64_t)(((unsigned __int128)h * sketch->nb_blocks) >> 64);
+  for (int r = 0; r < KAD_SKETCH_ROWS; r++)
+    cells[r] = r * KAD_SKETCH_WIDTH + ((h >> (3 * r)) & (KAD_SKETCH_WIDTH - 1));
+  return (uint16_t*)sketch->cells.data() + block * KAD_SKETCH_ROWS * KAD_SKETCH_WIDTH;
+}
+
+static inline void kad_sketch_add(kad_sketch_t* sketch, uint64_t kmer, uint16_t count) {
+  size_t cells[KAD_SKETCH_ROWS];
+  uint16_t* block = kad_sketch_block(sketch, kmer, cells);
+  for (int r = 0; r < KAD_SKETCH_ROWS; r++)
+    block[cells[r]] = std::max(block[cells[r]], count);
+}
+
+/* Upper bound of the count of kmer in any sample, 0 if it is absent */
+static inline uint16_t kad_sketch_get(const kad_sketch_t* sketch, uint64_t kmer) {
+  size_t cells[KAD_SKETCH_ROWS];
+  const uint16_t* block = kad_sketch_block(sketch, kmer, cells);
+  uint16_t bound = block[cells[0]];
+  for (int r = 1; r < KAD_SKETCH_ROWS; r++)
+    bound = std::min(bound, block[cells[r]]);
+  return bound;
+}
+
+/* 0 for a null count, b for a count in [2^(b-1), 2^b - 1] */
+static inline int count_bucket(uint16_t n) {
+  return n == 0 ? 0 : 32 - __builtin_clz(n);
+}
+
+/* A k-mer went from old_support to new_support sample counts */
+static inline void kad_stats_move(kad_stats_t* stats, size_t old_support, size_t new_support) {
+  if(new_support >= stats->support.size())
+    stats->support.resize(new_support + 1, 0);
+  if(old_support > 0)
+    stats->support[old_support]--;
+  stats->support[new_support]++;
+}
+
+/* Call f(kmer, counts, nb_counts) for every k-mer at a position from first
+ * to last (included), in the order of the keys of the backend */
+template <typename F>
+int kad_scan(kad_db_t* db, uint64_t first, uint64_t last, F f) {
+  const kad_backend_t* backend = db->backend;
+  kad_iterator_t it;
+  it.db = db;
+  it.first = first;
+  it.last = last;
+  backend->iterator_init(&it);
+  uint64_t kmer;
+  const count_t* counts;
+  size_t nb_counts;
+  int ret;
+  while ((ret = backend->iterator_next(&it, &kmer, &counts, &nb_counts)) == 1)
+    f(kmer, counts, nb_counts);
+  backend->iterator_free(&it);
+  return ret;
+}
+
+#endif